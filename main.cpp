@@ -9,30 +9,42 @@
 #include <limits> // Required for std::numeric_limits
 #include <cctype> // For toupper
 #include <atomic> // For atomic flag/counter
+#include <cstdint>
+#include <cstdlib>
+#include <new> // For std::nothrow
+#include <thread>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <iomanip>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h> // For MapViewOfFile
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h> // For mmap
+#include <sys/stat.h>
+#include <sys/wait.h> // For the analyse workers
+#include <unistd.h>
+#endif
+#ifdef USE_SYZYGY
+#include "tbprobe.h" // Fathom
+#endif
+#if defined(__AVX2__) || defined(__SSSE3__)
+#include <immintrin.h>
+#endif
 
 // Piece character constants
 const char EMPTY = ' ';
 const char W_PAWN = 'P', W_KNIGHT = 'N', W_BISHOP = 'B', W_ROOK = 'R', W_QUEEN = 'Q', W_KING = 'K';
 const char B_PAWN = 'p', B_KNIGHT = 'n', B_BISHOP = 'b', B_ROOK = 'r', B_QUEEN = 'q', B_KING = 'k';
 
-// Piece values for material evaluation (in centipawns)
-const std::map<char, int> piece_values = {
-    {W_PAWN, 100}, {B_PAWN, 100},
-    {W_KNIGHT, 320}, {B_KNIGHT, 320},
-    {W_BISHOP, 330}, {B_BISHOP, 330},
-    {W_ROOK, 500}, {B_ROOK, 500},
-    {W_QUEEN, 900}, {B_QUEEN, 900},
-    {W_KING, 20000}, {B_KING, 20000} 
-};
-// Simplified piece values for MVV-LVA (less granularity needed)
-const std::map<char, int> mvv_lva_piece_values = {
-    {W_PAWN, 1}, {B_PAWN, 1},
-    {W_KNIGHT, 3}, {B_KNIGHT, 3},
-    {W_BISHOP, 3}, {B_BISHOP, 3},
-    {W_ROOK, 5}, {B_ROOK, 5},
-    {W_QUEEN, 9}, {B_QUEEN, 9},
-    {W_KING, 10}, {B_KING, 10} 
-};
+// Piece values for material evaluation (in centipawns), indexed by PieceType
+const int piece_values[6] = {100, 320, 330, 500, 900, 20000};
 
 
 // --- Piece-Square Tables (PSTs) ---
@@ -46,98 +58,756 @@ const int king_pst_eg[64] = {-50,-40,-30,-20,-20,-30,-40,-50,-30,-20,-10,0,0,-10
 
 
 // Evaluation scores for terminal states (absolute value)
-const int MATE_SCORE = 100000; 
+const int MATE_SCORE = 32000; // Fits the 16-bit score field of a transposition table entry
 const int DRAW_SCORE = 0;     
 const int MAX_SEARCH_PLY = 64; 
-const int MAX_QUIESCENCE_PLY = 6; 
+const int MAX_QUIESCENCE_PLY = 16; // Safety net only: SEE and delta pruning keep quiescence short
 const int IN_CHECK_PENALTY = 50; 
-const int LMR_REDUCTION = 1; 
+const int DELTA_MARGIN = 200; // Quiescence delta pruning: most a capture can gain beyond the captured piece
 const int LMR_MIN_MOVES_TO_TRY_REDUCTION = 3; // Apply LMR after this many full-depth moves
 const int LMR_MIN_DEPTH_FOR_REDUCTION = 3; // Apply LMR only if current depth is at least this
 const int CHECK_EXTENSION_PLY = 1; // Extend search by this much if giving check
+const int MAX_PLY = 128; // Hard cap on distance from the root, including extensions and quiescence
+const int INFINITE_SCORE = MATE_SCORE + 1;
+const int MATE_IN_MAX_PLY = MATE_SCORE - MAX_PLY; // Scores beyond this are mates; mated at ply p scores -MATE_SCORE + p
+const int ASPIRATION_WINDOW = 25; // Initial half-width of the root window around the previous score, in centipawns
+const int ASPIRATION_MIN_DEPTH = 4;
+
+// --- Search Parameters ---
+// Pruning and reduction settings, each exposed as a UCI spin option (see SEARCH_PARAMS) for tuning
+int nmp_min_depth = 3;        // Null move pruning from this depth on
+int nmp_base_reduction = 3;   // Null move reduction: base + depth / divisor + (eval - beta) / eval divisor (at most 3)
+int nmp_depth_divisor = 4;
+int nmp_eval_divisor = 200;
+int rfp_max_depth = 8;        // Reverse futility: a node whose static eval beats beta by margin * depth returns it
+int rfp_margin = 75;
+int fp_max_depth = 6;         // Futility: quiet moves are skipped if static eval + base + margin * depth cannot reach alpha
+int fp_base = 100;
+int fp_margin = 80;
+int lmp_max_depth = 8;        // Late move pruning: quiet moves after the first base + depth * depth are skipped
+int lmp_base = 3;
+int lmr_base = 75;            // LMR: reduction = base / 100 + ln(depth) * ln(move number) / (divisor / 100)
+int lmr_divisor = 225;
+
+struct SearchParam { const char* name; int* value; int min, max; };
+const SearchParam SEARCH_PARAMS[] = {
+    {"NullMoveMinDepth", &nmp_min_depth, 1, 20},     {"NullMoveBaseReduction", &nmp_base_reduction, 1, 6},
+    {"NullMoveDepthDivisor", &nmp_depth_divisor, 1, 16}, {"NullMoveEvalDivisor", &nmp_eval_divisor, 50, 1000},
+    {"RfpMaxDepth", &rfp_max_depth, 0, 20},          {"RfpMargin", &rfp_margin, 10, 500},
+    {"FutilityMaxDepth", &fp_max_depth, 0, 20},      {"FutilityBase", &fp_base, 0, 1000},
+    {"FutilityMargin", &fp_margin, 10, 500},         {"LmpMaxDepth", &lmp_max_depth, 0, 20},
+    {"LmpBase", &lmp_base, 1, 50},                   {"LmrBase", &lmr_base, 0, 300},
+    {"LmrDivisor", &lmr_divisor, 50, 1000},
+};
+
+const int LMR_TABLE_SIZE = 64;
+int lmr_reductions[LMR_TABLE_SIZE][LMR_TABLE_SIZE]; // By depth and move number, both capped at the table size
+
+void initReductions() {
+    for (int d = 0; d < LMR_TABLE_SIZE; ++d) {
+        for (int m = 0; m < LMR_TABLE_SIZE; ++m) {
+            lmr_reductions[d][m] = (d == 0 || m == 0) ? 0
+                : (int)(lmr_base / 100.0 + std::log((double)d) * std::log((double)m) * 100.0 / lmr_divisor);
+        }
+    }
+}
+
+// --- Memory-Mapped Files ---
+// A view of a whole file. The pages are loaded by the OS on first access, so opening a large file costs
+// nothing up front and the memory is shared with the page cache. A writable view is private: pages are
+// copied when first written and the file itself never changes.
+struct MappedFile {
+    const unsigned char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE mapping = nullptr;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    bool open(const std::string& path, bool writable = false) {
+        close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0) {
+            mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+            if (mapping) data = (const unsigned char*)MapViewOfFile(mapping, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+            size = data ? (size_t)fileSize.QuadPart : 0;
+        }
+        CloseHandle(file); // The mapping keeps the file open
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* view = writable ? mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                                  : mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (view != MAP_FAILED) { data = (const unsigned char*)view; size = (size_t)st.st_size; }
+        }
+        ::close(fd); // The mapping keeps the file open
+#endif
+        if (!data) close();
+        return data != nullptr;
+    }
+    void swap(MappedFile& other) {
+        std::swap(data, other.data);
+        std::swap(size, other.size);
+#ifdef _WIN32
+        std::swap(mapping, other.mapping);
+#endif
+    }
+    void close() {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        if (data) munmap((void*)data, size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
 
-// Transposition Table Entry Flags
+// --- Transposition Table ---
+// A preallocated array of 64-byte (one cache line) buckets indexed by the Zobrist key. Each bucket
+// holds TT_BUCKET_SLOTS entries packed into one 64-bit data word, stored next to (key XOR data), so a
+// probe verifies the full key and a half-written slot simply fails that check. The table is shared by
+// all search threads without locks: both words are relaxed atomics, and a torn pair is just a miss.
 enum TTEntryFlag { TT_EXACT, TT_LOWERBOUND, TT_UPPERBOUND, TT_INVALID };
 struct TTEntry {
     int score;
     int depth;
     TTEntryFlag flag;
+    uint16_t move; // Best move (Move::data), 0 if none
+
+    TTEntry() : score(0), depth(-1), flag(TT_INVALID), move(0) {}
+};
+
+const int TT_BUCKET_SLOTS = 4;
+const size_t TT_DEFAULT_MB = 64;
+const size_t TT_MAX_MB = 65536;
+struct TTSlot { std::atomic<uint64_t> check; std::atomic<uint64_t> data; };
+struct alignas(64) TTBucket { TTSlot slots[TT_BUCKET_SLOTS]; };
+
+// data word layout: move (16) | score (16) | depth + 1 (8) | flag (2) | generation (6). data == 0 is an empty slot.
+struct TranspositionTable {
+    TTBucket* buckets = nullptr;
+    size_t bucketCount = 0;
+    size_t sizeMb = 0;
+    uint8_t generation = 0; // Bumped once per search; older entries are replaced first
+    MappedFile mapped;      // After "loadhash" the buckets live in a private view of the hash file instead
+
+    ~TranspositionTable() { release(); }
+
+    void release() {
+        if (mapped.data) mapped.close(); else delete[] buckets;
+        buckets = nullptr;
+    }
+    void resize(size_t mb) {
+        mb = std::max<size_t>(1, std::min(mb, TT_MAX_MB));
+        size_t count = mb * 1024 * 1024 / sizeof(TTBucket);
+        TTBucket* fresh = new (std::nothrow) TTBucket[count];
+        if (!fresh) { std::cout << "info string failed to allocate " << mb << " MB hash" << std::endl; return; }
+        release();
+        buckets = fresh; bucketCount = count; sizeMb = mb;
+        clear();
+    }
+    void clear() {
+        for (size_t i = 0; i < bucketCount; ++i) {
+            for (TTSlot& slot : buckets[i].slots) { slot.check.store(0, std::memory_order_relaxed); slot.data.store(0, std::memory_order_relaxed); }
+        }
+        generation = 0;
+    }
+    void newSearch() { generation = (generation + 1) & 63; }
+
+    TTBucket& bucketFor(uint64_t key) const { return buckets[(size_t)(((unsigned __int128)key * bucketCount) >> 64)]; }
+    static int depthOf(uint64_t data) { return (int)((data >> 32) & 0xFF) - 1; }
+    static int generationOf(uint64_t data) { return (int)((data >> 42) & 63); }
+
+    bool probe(uint64_t key, TTEntry& entry) const {
+        for (const TTSlot& slot : bucketFor(key).slots) {
+            uint64_t data = slot.data.load(std::memory_order_relaxed);
+            if (data == 0 || (slot.check.load(std::memory_order_relaxed) ^ data) != key) continue;
+            entry.move = (uint16_t)(data & 0xFFFF);
+            entry.score = (int16_t)((data >> 16) & 0xFFFF);
+            entry.depth = depthOf(data);
+            entry.flag = (TTEntryFlag)((data >> 40) & 3);
+            return true;
+        }
+        return false;
+    }
+
+    // Replaces the entry for the same position if present, otherwise an empty slot, otherwise the
+    // slot with the lowest depth once each generation of age counts as 8 plies less depth.
+    void store(uint64_t key, int depth, int score, TTEntryFlag flag, uint16_t move) {
+        TTSlot* target = nullptr;
+        int lowestValue = std::numeric_limits<int>::max();
+        for (TTSlot& slot : bucketFor(key).slots) {
+            uint64_t data = slot.data.load(std::memory_order_relaxed);
+            if (data == 0 || (slot.check.load(std::memory_order_relaxed) ^ data) == key) {
+                if (move == 0 && data != 0) move = (uint16_t)(data & 0xFFFF); // Keep the old best move
+                target = &slot;
+                break;
+            }
+            int value = depthOf(data) - 8 * ((generation - generationOf(data)) & 63);
+            if (value < lowestValue) { lowestValue = value; target = &slot; }
+        }
+        score = std::max(-32767, std::min(32767, score));
+        uint64_t data = (uint64_t)move | ((uint64_t)(uint16_t)(int16_t)score << 16) |
+                        ((uint64_t)std::max(0, std::min(254, depth + 1)) << 32) |
+                        ((uint64_t)flag << 40) | ((uint64_t)generation << 42);
+        target->data.store(data, std::memory_order_relaxed);
+        target->check.store(key ^ data, std::memory_order_relaxed);
+    }
+
+    // Permille of sampled slots written during the current search, for the UCI hashfull field
+    int hashfull() const {
+        int used = 0, sampled = 0;
+        for (size_t i = 0; i < std::min<size_t>(bucketCount, 250); ++i) {
+            for (const TTSlot& slot : buckets[i].slots) {
+                sampled++;
+                uint64_t data = slot.data.load(std::memory_order_relaxed);
+                if (data != 0 && generationOf(data) == generation) used++;
+            }
+        }
+        return sampled ? used * 1000 / sampled : 0;
+    }
+};
+TranspositionTable transpositionTable;
+
+// --- Bitboards ---
+// Square index = row * 8 + col, matching board[row][col] and the PSTs: a8 = 0, h8 = 7, a1 = 56, h1 = 63.
+typedef uint64_t Bitboard;
+enum PieceType { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING, NO_PIECE_TYPE };
+const int WHITE = 0, BLACK = 1;
+const char PIECE_CHARS[2][6] = {{W_PAWN, W_KNIGHT, W_BISHOP, W_ROOK, W_QUEEN, W_KING},
+                                {B_PAWN, B_KNIGHT, B_BISHOP, B_ROOK, B_QUEEN, B_KING}};
+
+const Bitboard FILE_A_BB = 0x0101010101010101ULL;
+const Bitboard FILE_H_BB = FILE_A_BB << 7;
+const Bitboard RANK_8_BB = 0xFFULL;       // Row 0
+const Bitboard RANK_1_BB = 0xFFULL << 56; // Row 7
+
+inline Bitboard squareBB(int sq) { return 1ULL << sq; }
+inline int lsb(Bitboard b) { return __builtin_ctzll(b); }
+inline int popLsb(Bitboard& b) { int sq = lsb(b); b &= b - 1; return sq; }
+inline int popCount(Bitboard b) { return __builtin_popcountll(b); }
+
+// Index 0-5 for white pieces, 6-11 for black, -1 for EMPTY
+int pieceIndex(char piece) {
+    switch (piece) {
+        case W_PAWN: return 0; case W_KNIGHT: return 1; case W_BISHOP: return 2;
+        case W_ROOK: return 3; case W_QUEEN: return 4; case W_KING: return 5;
+        case B_PAWN: return 6; case B_KNIGHT: return 7; case B_BISHOP: return 8;
+        case B_ROOK: return 9; case B_QUEEN: return 10; case B_KING: return 11;
+        default: return -1;
+    }
+}
+
+Bitboard knight_attacks[64], king_attacks[64];
+Bitboard pawn_attacks[2][64]; // Squares attacked by a pawn of the given colour standing on the square
+
+// "Fancy" magic bitboards: the relevant blockers of a slider are multiplied by a magic number so the
+// top bits form a perfect index into that square's precomputed attack table.
+struct Magic {
+    Bitboard mask;
+    Bitboard magic;
+    Bitboard* attacks;
+    unsigned shift;
+    unsigned index(Bitboard occupied) const { return (unsigned)(((occupied & mask) * magic) >> shift); }
+};
+Magic rook_magics[64], bishop_magics[64];
+Bitboard rook_attack_table[0x19000], bishop_attack_table[0x1480];
+Bitboard between_bb[64][64]; // Squares strictly between two squares on a rank, file or diagonal, else 0
+Bitboard line_bb[64][64];    // The whole line through two such squares, edge to edge, else 0
+
+const int ROOK_DELTAS[4][2] = {{0,1},{0,-1},{1,0},{-1,0}};
+const int BISHOP_DELTAS[4][2] = {{1,1},{1,-1},{-1,1},{-1,-1}};
+
+inline Bitboard rookAttacks(int sq, Bitboard occupied) { const Magic& m = rook_magics[sq]; return m.attacks[m.index(occupied)]; }
+inline Bitboard bishopAttacks(int sq, Bitboard occupied) { const Magic& m = bishop_magics[sq]; return m.attacks[m.index(occupied)]; }
+inline Bitboard queenAttacks(int sq, Bitboard occupied) { return rookAttacks(sq, occupied) | bishopAttacks(sq, occupied); }
+
+// Ray-walking attack generation, only used to fill the tables at startup
+Bitboard slidingAttacks(int sq, Bitboard occupied, const int deltas[4][2]) {
+    Bitboard attacks = 0;
+    for (int d = 0; d < 4; ++d) {
+        for (int r = sq / 8 + deltas[d][0], c = sq % 8 + deltas[d][1]; r >= 0 && r < 8 && c >= 0 && c < 8; r += deltas[d][0], c += deltas[d][1]) {
+            attacks |= squareBB(r * 8 + c);
+            if (occupied & squareBB(r * 8 + c)) break;
+        }
+    }
+    return attacks;
+}
+
+// Magic numbers found once by the search in initMagics (seed 728), so startup only has to fill the tables
+const Bitboard ROOK_MAGIC_NUMBERS[64] = {
+    0x0280132180004001ULL, 0x0140001000200040ULL, 0x0880200010000880ULL, 0x2080080005801000ULL,
+    0x0200041020080200ULL, 0x0200041041084200ULL, 0x0400080081124410ULL, 0x2180042100004080ULL,
+    0x8000800099644000ULL, 0x0802003040820100ULL, 0x0105801001862000ULL, 0x0101002008100100ULL,
+    0x1000800400080080ULL, 0x0804800200040080ULL, 0x2001800200800900ULL, 0x00160004088204c1ULL,
+    0x228000c001402000ULL, 0x8510004000200050ULL, 0x3001848020029000ULL, 0x0280808010000801ULL,
+    0x0109010010040800ULL, 0x8000808004000200ULL, 0x8000040081021028ULL, 0x40040a0009004884ULL,
+    0x80c0004280008035ULL, 0x0010004040002000ULL, 0x1101200500410070ULL, 0x8410100080080080ULL,
+    0x000c080080800400ULL, 0x4012008080040002ULL, 0x4000040101000200ULL, 0x0061010200008044ULL,
+    0x0080804010800020ULL, 0x3000201008400040ULL, 0x4112008012002444ULL, 0x0848000880801000ULL,
+    0x00a8008008800400ULL, 0x200200280a00500cULL, 0x080a221024004801ULL, 0xc400008042000104ULL,
+    0x8000400080028022ULL, 0x0220008040018020ULL, 0x4000200011010040ULL, 0x10060040210a0010ULL,
+    0x40820020904a0004ULL, 0x0030040002008080ULL, 0x0200020801840010ULL, 0x0084c04100820004ULL,
+    0x4802010080c2a600ULL, 0x0000400080201880ULL, 0x2040801000200080ULL, 0x0180200842001200ULL,
+    0x0013510008000500ULL, 0x0182000c00808a80ULL, 0x1000524821302400ULL, 0x3800040108488200ULL,
+    0x104a004810210082ULL, 0x0004210010420082ULL, 0xc424110008200241ULL, 0x90101000a0088501ULL,
+    0x0182000420100802ULL, 0x4822001001080402ULL, 0x05d0080090012204ULL, 0x2008140089042846ULL,
+};
+const Bitboard BISHOP_MAGIC_NUMBERS[64] = {
+    0xc820611041010022ULL, 0x4c42420801010800ULL, 0x0c10040090290000ULL, 0x0484410021085840ULL,
+    0x00040420001a0000ULL, 0x01088a20a0000480ULL, 0xc024048a30120020ULL, 0x4008140084046020ULL,
+    0x0600146008024680ULL, 0x1221030202040508ULL, 0x24c8100080910421ULL, 0x00012220820c4000ULL,
+    0x2400040421106108ULL, 0x0010010482400000ULL, 0x0000044242202001ULL, 0x4686208404020240ULL,
+    0x00403c16b0620200ULL, 0x0020001011822284ULL, 0x1004000800440008ULL, 0x2488002104110320ULL,
+    0x1010811401e00001ULL, 0x3284080a02010400ULL, 0xa045012414020240ULL, 0x0141022040480420ULL,
+    0x1220280070900100ULL, 0x0004040010018818ULL, 0x4044500c08002040ULL, 0x1040808008020002ULL,
+    0x0001001201004000ULL, 0x0124830004806000ULL, 0x04111040040404a0ULL, 0x010c208001008080ULL,
+    0x2422602000100200ULL, 0x2002080204204240ULL, 0x0002002481100308ULL, 0xe102202020880080ULL,
+    0x1c2404040002d100ULL, 0x1020010040020800ULL, 0x0001042400010100ULL, 0x0001005090420200ULL,
+    0x0489180840800400ULL, 0x0428a80802014804ULL, 0x0020a02030001800ULL, 0x0640054200800800ULL,
+    0x0010400408200502ULL, 0x00c0100400400020ULL, 0x2020040440840050ULL, 0x201800a102000050ULL,
+    0x0104120110080000ULL, 0x0020210402200000ULL, 0x0808960500882140ULL, 0x0001000020a80208ULL,
+    0x0040819202020000ULL, 0x5d14100210610200ULL, 0x00a8021002421834ULL, 0x42101000c1004400ULL,
+    0x0401002090280800ULL, 0x7801290092100244ULL, 0x0884351100880400ULL, 0x0920090001084800ULL,
+    0x64014c8a49430400ULL, 0xc412080408100104ULL, 0x0400100282080200ULL, 0x4010041088020220ULL,
+};
+
+// Each square starts from its precomputed magic; only if that one collides (the mask or table layout has
+// changed) is a new one searched for, from a fixed seed.
+void initMagics(Magic magics[], Bitboard table[], const int deltas[4][2], const Bitboard precomputed[64]) {
+    std::mt19937_64 rng(728); // Fixed seed so startup time and tables are the same every run
+    static Bitboard occupancy[4096], reference[4096];
+    static int epoch[4096];
+    int attempt = 0;
+    Bitboard* next = table;
+    for (int sq = 0; sq < 64; ++sq) {
+        Magic& m = magics[sq];
+        Bitboard rowBB = RANK_8_BB << (8 * (sq / 8)), colBB = FILE_A_BB << (sq % 8);
+        Bitboard edges = ((RANK_8_BB | RANK_1_BB) & ~rowBB) | ((FILE_A_BB | FILE_H_BB) & ~colBB);
+        m.mask = slidingAttacks(sq, 0, deltas) & ~edges;
+        m.shift = 64 - popCount(m.mask);
+        m.attacks = next;
+        int size = 0;
+        Bitboard subset = 0;
+        do { // Enumerate every subset of the mask (Carry-Rippler)
+            occupancy[size] = subset;
+            reference[size] = slidingAttacks(sq, subset, deltas);
+            size++;
+            subset = (subset - m.mask) & m.mask;
+        } while (subset);
+        next += size;
+        for (int i = 0, tries = 0; i < size; ++tries) {
+            if (tries == 0) m.magic = precomputed[sq];
+            else for (m.magic = 0; popCount((m.magic * m.mask) >> 56) < 6; ) m.magic = rng() & rng() & rng();
+            ++attempt;
+            for (i = 0; i < size; ++i) {
+                unsigned idx = m.index(occupancy[i]);
+                if (epoch[idx] < attempt) { epoch[idx] = attempt; m.attacks[idx] = reference[i]; }
+                else if (m.attacks[idx] != reference[i]) break;
+            }
+        }
+    }
+}
+
+void initBitboards() {
+    const int knight_deltas[8][2] = {{-2,-1},{-2,1},{-1,-2},{-1,2},{1,-2},{1,2},{2,-1},{2,1}};
+    const int king_deltas[8][2] = {{-1,-1},{-1,0},{-1,1},{0,-1},{0,1},{1,-1},{1,0},{1,1}};
+    for (int sq = 0; sq < 64; ++sq) {
+        int r = sq / 8, c = sq % 8;
+        knight_attacks[sq] = king_attacks[sq] = pawn_attacks[WHITE][sq] = pawn_attacks[BLACK][sq] = 0;
+        for (int i = 0; i < 8; ++i) {
+            int nr = r + knight_deltas[i][0], nc = c + knight_deltas[i][1];
+            if (nr >= 0 && nr < 8 && nc >= 0 && nc < 8) knight_attacks[sq] |= squareBB(nr * 8 + nc);
+            nr = r + king_deltas[i][0]; nc = c + king_deltas[i][1];
+            if (nr >= 0 && nr < 8 && nc >= 0 && nc < 8) king_attacks[sq] |= squareBB(nr * 8 + nc);
+        }
+        for (int dc : {-1, 1}) {
+            if (c + dc < 0 || c + dc > 7) continue;
+            if (r > 0) pawn_attacks[WHITE][sq] |= squareBB((r - 1) * 8 + c + dc); // White pawns move towards row 0
+            if (r < 7) pawn_attacks[BLACK][sq] |= squareBB((r + 1) * 8 + c + dc);
+        }
+    }
+    initMagics(rook_magics, rook_attack_table, ROOK_DELTAS, ROOK_MAGIC_NUMBERS);
+    initMagics(bishop_magics, bishop_attack_table, BISHOP_DELTAS, BISHOP_MAGIC_NUMBERS);
+    for (int s1 = 0; s1 < 64; ++s1) {
+        for (int s2 = 0; s2 < 64; ++s2) {
+            between_bb[s1][s2] = line_bb[s1][s2] = 0;
+            if (s1 == s2) continue;
+            if (rookAttacks(s1, 0) & squareBB(s2)) {
+                between_bb[s1][s2] = rookAttacks(s1, squareBB(s2)) & rookAttacks(s2, squareBB(s1));
+                line_bb[s1][s2] = (rookAttacks(s1, 0) & rookAttacks(s2, 0)) | squareBB(s1) | squareBB(s2);
+            } else if (bishopAttacks(s1, 0) & squareBB(s2)) {
+                between_bb[s1][s2] = bishopAttacks(s1, squareBB(s2)) & bishopAttacks(s2, squareBB(s1));
+                line_bb[s1][s2] = (bishopAttacks(s1, 0) & bishopAttacks(s2, 0)) | squareBB(s1) | squareBB(s2);
+            }
+        }
+    }
+}
 
-    TTEntry() : score(0), depth(-1), flag(TT_INVALID) {}
+// --- Zobrist Hashing ---
+// Random keys for each (piece, square), each castling right, each en passant file and the side to move.
+// The position key is the XOR of the keys of everything present, so a move only touches a few of them.
+uint64_t zobrist_pieces[12][64];
+uint64_t zobrist_castling[16]; // Indexed by the CASTLE_* rights mask
+uint64_t zobrist_ep_file[8];
+uint64_t zobrist_black_to_move;
+
+uint64_t zobristPieceKey(char piece, int sq) { return zobrist_pieces[pieceIndex(piece)][sq]; }
+
+void initZobrist() {
+    std::mt19937_64 rng(0x9E3779B97F4A7C15ULL); // Fixed seed: keys are identical on every run
+    for (auto& piece_keys : zobrist_pieces) for (auto& key : piece_keys) key = rng();
+    uint64_t castle_keys[4];
+    for (auto& key : castle_keys) key = rng();
+    for (int rights = 0; rights < 16; ++rights) {
+        zobrist_castling[rights] = 0;
+        for (int i = 0; i < 4; ++i) if (rights & (1 << i)) zobrist_castling[rights] ^= castle_keys[i];
+    }
+    for (auto& key : zobrist_ep_file) key = rng();
+    zobrist_black_to_move = rng();
+}
+
+// --- Hash Files ---
+// "savehash <file>" writes the transposition table as a 64-byte header followed by the buckets exactly as
+// they are in memory; "loadhash <file>" maps such a file copy-on-write and searches on it directly, so a
+// table of any size loads at once and its pages are read from disk as the search touches them. The
+// header records the format version, the bucket count and a fingerprint of the Zobrist keys, so a file
+// from an incompatible build is refused. "ucinewgame" clears the table, so load it after that.
+const uint32_t HASH_FILE_VERSION = 1;
+struct HashFileHeader {
+    char magic[4];        // "GMTT"
+    uint32_t version;     // HASH_FILE_VERSION
+    uint64_t bucketCount;
+    uint64_t keyCheck;    // hashFileKeyCheck() of the build that wrote it
+    uint32_t bucketSize;  // sizeof(TTBucket)
+    uint32_t generation;
+    uint8_t reserved[32];
+};
+static_assert(sizeof(HashFileHeader) == sizeof(TTBucket), "the buckets must stay cache-line aligned in the file");
+static_assert(sizeof(TTSlot) == 16 && std::atomic<uint64_t>::is_always_lock_free, "slots are saved as raw words");
+
+uint64_t hashFileKeyCheck() {
+    uint64_t check = zobrist_black_to_move;
+    for (int i = 0; i < 12; ++i) check ^= zobrist_pieces[i][(i * 5) & 63] + zobrist_castling[i & 15] + zobrist_ep_file[i & 7];
+    return check;
+}
+
+bool saveHash(const std::string& path) {
+    HashFileHeader header = {};
+    std::memcpy(header.magic, "GMTT", 4);
+    header.version = HASH_FILE_VERSION;
+    header.bucketCount = transpositionTable.bucketCount;
+    header.keyCheck = hashFileKeyCheck();
+    header.bucketSize = sizeof(TTBucket);
+    header.generation = transpositionTable.generation;
+    // Written next to the target and renamed over it: the file may be the one the table is mapped from,
+    // and truncating that in place would pull the pages out from under the mapping
+    std::string tempPath = path + ".tmp";
+    std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    out.write((const char*)&header, sizeof(header));
+    out.write((const char*)transpositionTable.buckets, (std::streamsize)(transpositionTable.bucketCount * sizeof(TTBucket)));
+    out.close();
+    if (!out) { std::remove(tempPath.c_str()); return false; }
+#ifdef _WIN32
+    std::remove(path.c_str()); // rename does not replace an existing file on Windows
+#endif
+    return std::rename(tempPath.c_str(), path.c_str()) == 0;
+}
+
+// On any error the current table stays in use
+bool loadHash(const std::string& path) {
+    MappedFile file;
+    if (!file.open(path, true) || file.size < sizeof(HashFileHeader)) return false;
+    HashFileHeader header;
+    std::memcpy(&header, file.data, sizeof(header));
+    if (std::memcmp(header.magic, "GMTT", 4) != 0 || header.version != HASH_FILE_VERSION ||
+        header.keyCheck != hashFileKeyCheck() || header.bucketSize != sizeof(TTBucket) || header.bucketCount == 0 ||
+        file.size != sizeof(header) + header.bucketCount * sizeof(TTBucket)) return false;
+    TranspositionTable& tt = transpositionTable;
+    tt.release();
+    tt.mapped.swap(file);
+    tt.buckets = (TTBucket*)const_cast<unsigned char*>(tt.mapped.data + sizeof(header)); // Writable: the view is private
+    tt.bucketCount = header.bucketCount;
+    tt.sizeMb = tt.mapped.size / (1024 * 1024);
+    tt.generation = (uint8_t)(header.generation & 63);
+    return true;
+}
+
+// --- Incremental Evaluation Terms ---
+// Material plus PST value of each (piece index, square), signed from White's point of view, for the
+// midgame and the endgame. BoardState keeps their running sums and the game phase, so evaluation never
+// scans the board. Only the king tables differ between the two phases.
+int psqt_mg[12][64], psqt_eg[12][64];
+const int phase_weights[6] = {0, 1, 1, 2, 4, 0}; // Per piece type; the starting position has PHASE_MAX
+const int PHASE_MAX = 24;
+
+void initPsqt() {
+    const int* const tables[6] = {pawn_pst, knight_pst, bishop_pst, rook_pst, queen_pst, king_pst_mg};
+    for (int idx = 0; idx < 12; ++idx) {
+        int pt = idx % 6, sign = (idx < 6) ? 1 : -1;
+        for (int sq = 0; sq < 64; ++sq) {
+            int tableSq = (idx < 6) ? sq : sq ^ 56; // PSTs are from White's view; flip rows for Black
+            psqt_mg[idx][sq] = sign * (piece_values[pt] + tables[pt][tableSq]);
+            psqt_eg[idx][sq] = sign * (piece_values[pt] + (pt == KING ? king_pst_eg : tables[pt])[tableSq]);
+        }
+    }
+}
+
+// --- NNUE Evaluation ---
+// Optional efficiently updatable network, loaded with the EvalFile option: (768 -> NNUE_HIDDEN) x 2 -> 1.
+// The inputs are piece-square features seen from each side: own pieces first, and squares numbered from
+// that side's back rank. Each side's first-layer sums (its accumulator) live in BoardState and are kept
+// up to date by putPiece/removePiece/movePiece. The output clips both accumulators to [0, NNUE_QA], side
+// to move first, and takes their dot product with int8 weights.
+//
+// File format (little endian): "GMNN", uint32 version (NNUE_VERSION), uint32 hidden size (NNUE_HIDDEN),
+// int16 feature weights [768][NNUE_HIDDEN], int16 feature biases [NNUE_HIDDEN],
+// int8 output weights [2 * NNUE_HIDDEN], int32 output bias.
+const int NNUE_INPUTS = 768;
+const int NNUE_HIDDEN = 256;
+const int NNUE_QA = 127;    // Activation clip, so activations fit in uint8 for the int8 dot product
+const int NNUE_QB = 64;     // Output weight scale
+const int NNUE_SCALE = 400; // Centipawns per unit of network output
+const uint32_t NNUE_VERSION = 1;
+
+struct NnueNetwork {
+    alignas(32) int16_t featureWeights[NNUE_INPUTS][NNUE_HIDDEN];
+    alignas(32) int16_t featureBias[NNUE_HIDDEN];
+    alignas(32) int8_t outputWeights[2 * NNUE_HIDDEN];
+    int32_t outputBias;
+};
+std::unique_ptr<NnueNetwork> nnue_net; // Null while no net is loaded: the PST evaluation is used
+
+// Feature of the piece with pieceIndex idx on sq, for the accumulator of `perspective`
+inline int nnueFeature(int perspective, int idx, int sq) {
+    int color = idx / 6, pt = idx % 6;
+    return ((color == perspective ? 0 : 6) + pt) * 64 + (perspective == WHITE ? sq : sq ^ 56);
+}
+
+// acc += weights (or -=) over NNUE_HIDDEN lanes
+template <bool Add>
+inline void nnueUpdate(int16_t* acc, const int16_t* weights) {
+#if defined(__AVX2__)
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m256i a = _mm256_load_si256((const __m256i*)(acc + i)), w = _mm256_load_si256((const __m256i*)(weights + i));
+        _mm256_store_si256((__m256i*)(acc + i), Add ? _mm256_add_epi16(a, w) : _mm256_sub_epi16(a, w));
+    }
+#elif defined(__SSSE3__)
+    for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+        __m128i a = _mm_load_si128((const __m128i*)(acc + i)), w = _mm_load_si128((const __m128i*)(weights + i));
+        _mm_store_si128((__m128i*)(acc + i), Add ? _mm_add_epi16(a, w) : _mm_sub_epi16(a, w));
+    }
+#else
+    for (int i = 0; i < NNUE_HIDDEN; ++i) acc[i] = Add ? acc[i] + weights[i] : acc[i] - weights[i];
+#endif
+}
+
+// Sum over NNUE_HIDDEN lanes of clamp(acc, 0, NNUE_QA) * weights. The clipped activations are packed to
+// uint8 so that maddubs multiplies 32 (AVX2) or 16 (SSSE3) pairs at once; pair sums stay below 2^15.
+inline int32_t nnueDot(const int16_t* acc, const int8_t* weights) {
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256(), qa = _mm256_set1_epi16(NNUE_QA), ones = _mm256_set1_epi16(1);
+    __m256i sum = _mm256_setzero_si256();
+    for (int i = 0; i < NNUE_HIDDEN; i += 32) {
+        __m256i a0 = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(acc + i)), zero), qa);
+        __m256i a1 = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i*)(acc + i + 16)), zero), qa);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a0, a1), 0xD8); // packus works per 128-bit lane
+        __m256i products = _mm256_maddubs_epi16(packed, _mm256_load_si256((const __m256i*)(weights + i)));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(products, ones));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return _mm_cvtsi128_si32(s);
+#elif defined(__SSSE3__)
+    const __m128i zero = _mm_setzero_si128(), qa = _mm_set1_epi16(NNUE_QA), ones = _mm_set1_epi16(1);
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+        __m128i a0 = _mm_min_epi16(_mm_max_epi16(_mm_load_si128((const __m128i*)(acc + i)), zero), qa);
+        __m128i a1 = _mm_min_epi16(_mm_max_epi16(_mm_load_si128((const __m128i*)(acc + i + 8)), zero), qa);
+        __m128i products = _mm_maddubs_epi16(_mm_packus_epi16(a0, a1), _mm_load_si128((const __m128i*)(weights + i)));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(products, ones));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    return _mm_cvtsi128_si32(sum);
+#else
+    int32_t sum = 0;
+    for (int i = 0; i < NNUE_HIDDEN; ++i) sum += std::max(0, std::min((int)acc[i], NNUE_QA)) * weights[i];
+    return sum;
+#endif
+}
+
+// One accumulator per entry of BoardState's undo stack. doMove only records which pieces changed; the
+// sums are brought up to date when a position is evaluated, starting from the nearest computed ancestor.
+// So the make/unmake pairs of legality tests and moves that are never evaluated cost nothing.
+struct DirtyPiece { int idx, from, to; }; // from / to is -1 when the piece appears / disappears
+struct NnueAccumulator {
+    alignas(32) int16_t values[2][NNUE_HIDDEN]; // First-layer sums per perspective
+    bool computed = false;
+    int dirtyCount = -1; // -1: no record of how this position was reached, so refresh from scratch
+    DirtyPiece dirty[3];
 };
-std::map<std::string, TTEntry> transpositionTable;
-const size_t MAX_TT_SIZE = 1000000; 
+
+// Reads a network in the format above; on any error the current net (or the PST fallback) stays in use.
+bool loadNnue(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[4] = {};
+    uint32_t version = 0, hidden = 0;
+    in.read(magic, 4);
+    in.read((char*)&version, sizeof(version));
+    in.read((char*)&hidden, sizeof(hidden));
+    if (!in || std::memcmp(magic, "GMNN", 4) != 0 || version != NNUE_VERSION || hidden != (uint32_t)NNUE_HIDDEN) return false;
+    std::unique_ptr<NnueNetwork> net(new (std::nothrow) NnueNetwork);
+    if (!net) return false;
+    in.read((char*)net->featureWeights, sizeof(net->featureWeights));
+    in.read((char*)net->featureBias, sizeof(net->featureBias));
+    in.read((char*)net->outputWeights, sizeof(net->outputWeights));
+    in.read((char*)&net->outputBias, sizeof(net->outputBias));
+    if (!in) return false;
+    nnue_net = std::move(net);
+    return true;
+}
 
 // --- Forward Declarations ---
 struct BoardState;
 struct Move; 
-void generateLegalMoves(const BoardState& state, std::vector<Move>& legal_moves, bool capturesOnly = false);
+struct MoveList;
+void generateLegalMoves(BoardState& state, MoveList& legal_moves, bool capturesOnly = false);
 bool isKingInCheck(const BoardState& state, bool kingIsWhite);
-bool isSquareAttacked(const BoardState& state, int r, int c, bool byWhiteAttacker);
-void apply_raw_move_to_board(BoardState& state, const Move& move);
+bool isSquareAttacked(const BoardState& state, int sq, bool byWhiteAttacker);
 void master_apply_move(const Move& move); 
 int evaluateBoard(const BoardState& state); 
-int alphaBetaSearch(BoardState state, int depth, int alpha, int beta, bool maximizingPlayer, 
-                    const std::chrono::steady_clock::time_point& startTime, 
-                    const std::chrono::milliseconds& timeLimit); 
-int quiescenceSearch(BoardState state, int alpha, int beta, bool maximizingPlayer,
-                     const std::chrono::steady_clock::time_point& startTime,
-                     const std::chrono::milliseconds& timeLimit, int quiescenceDepth);
-char getPieceAt(const BoardState& state, int r, int c); 
-void orderMoves(const BoardState& state, std::vector<Move>& moves);
+struct SearchThread;
+int alphaBetaSearch(SearchThread& td, int depth, int ply, int alpha, int beta); 
+int quiescenceSearch(SearchThread& td, int ply, int alpha, int beta, int quiescenceDepth);
+void orderMoves(const BoardState& state, MoveList& moves);
 
 
 // Global flag to signal time out (checked within search)
 std::atomic<bool> time_is_up = false; 
-// Global node counter for time checks
-std::atomic<uint64_t> nodes_searched = 0; 
 
 
 // --- Move Structure --- 
+// A move packs into 16 bits: from square (6) | to square (6) | flag (4). Promotion flags equal the PieceType
+// promoted to; castling and en passant get their own flag. Move() (a8a8) is the null move.
+enum MoveFlag { FLAG_NONE = 0, FLAG_PROMO_KNIGHT = KNIGHT, FLAG_PROMO_BISHOP = BISHOP, FLAG_PROMO_ROOK = ROOK,
+                FLAG_PROMO_QUEEN = QUEEN, FLAG_CASTLE, FLAG_EN_PASSANT };
+
 struct Move {
-    int fromRow, fromCol;
-    int toRow, toCol;
-    char promotionPiece; 
-    bool isKingSideCastle;
-    bool isQueenSideCastle;
-    bool isEnPassantCapture;
-    int score; 
-    
-    Move(int fr=0, int fc=0, int tr=0, int tc=0, char promo=EMPTY, bool ksc=false, bool qsc=false, bool ep=false)
-        : fromRow(fr), fromCol(fc), toRow(tr), toCol(tc), promotionPiece(promo),
-          isKingSideCastle(ksc), isQueenSideCastle(qsc), isEnPassantCapture(ep), score(0) {}
-          
+    uint16_t data;
+
+    Move() : data(0) {}
+    explicit Move(uint16_t raw) : data(raw) {}
+    Move(int from, int to, int flag = FLAG_NONE) : data((uint16_t)(from | (to << 6) | (flag << 12))) {}
+
+    int fromSquare() const { return data & 63; }
+    int toSquare() const { return (data >> 6) & 63; }
+    int flag() const { return data >> 12; }
+    bool isPromotion() const { return flag() >= FLAG_PROMO_KNIGHT && flag() <= FLAG_PROMO_QUEEN; }
+    int promotionType() const { return flag(); } // Only meaningful if isPromotion()
+    bool isCastle() const { return flag() == FLAG_CASTLE; }
+    bool isKingSideCastle() const { return isCastle() && toSquare() > fromSquare(); }
+    bool isQueenSideCastle() const { return isCastle() && toSquare() < fromSquare(); }
+    bool isEnPassantCapture() const { return flag() == FLAG_EN_PASSANT; }
+
     std::string toUci() const {
         std::string uci = "";
-        uci += (char)('a' + fromCol); uci += (char)('8' - fromRow);
-        uci += (char)('a' + toCol); uci += (char)('8' - toRow);
-        if (promotionPiece != EMPTY) uci += tolower(promotionPiece);
+        uci += (char)('a' + (fromSquare() & 7)); uci += (char)('8' - (fromSquare() >> 3));
+        uci += (char)('a' + (toSquare() & 7)); uci += (char)('8' - (toSquare() >> 3));
+        if (isPromotion()) uci += PIECE_CHARS[BLACK][promotionType()];
         return uci;
     }
-    
-    bool operator==(const Move& other) const {
-        return fromRow==other.fromRow && fromCol==other.fromCol && toRow==other.toRow && 
-               toCol==other.toCol && promotionPiece==other.promotionPiece && 
-               isKingSideCastle==other.isKingSideCastle && isQueenSideCastle==other.isQueenSideCastle &&
-               isEnPassantCapture==other.isEnPassantCapture;
-    }
-    
+
+    bool operator==(const Move& other) const { return data == other.data; }
+    bool operator!=(const Move& other) const { return data != other.data; }
+
     bool isCapture(const BoardState& state) const; 
 };
 
+const int MAX_MOVES = 256; // No chess position has more legal moves (the record is 218)
+
+// Fixed-capacity move list with inline storage, so generation never touches the heap. scores[] runs
+// parallel to moves[] and holds whatever the current consumer orders by.
+struct MoveList {
+    Move moves[MAX_MOVES];
+    int scores[MAX_MOVES];
+    int count = 0;
+
+    void add(Move move) { moves[count++] = move; }
+    void clear() { count = 0; }
+    int size() const { return count; }
+    bool empty() const { return count == 0; }
+    Move& operator[](int i) { return moves[i]; }
+    const Move& operator[](int i) const { return moves[i]; }
+    Move* begin() { return moves; }
+    Move* end() { return moves + count; }
+    const Move* begin() const { return moves; }
+    const Move* end() const { return moves + count; }
+    void swap(int i, int j) { std::swap(moves[i], moves[j]); std::swap(scores[i], scores[j]); }
+    // Stable insertion sort of [first, count) by descending score; the lists are short and mostly ordered
+    void sortByScore(int first = 0) {
+        for (int i = first + 1; i < count; ++i) {
+            Move m = moves[i]; int sc = scores[i]; int j = i - 1;
+            for (; j >= first && scores[j] < sc; --j) { moves[j + 1] = moves[j]; scores[j + 1] = scores[j]; }
+            moves[j + 1] = m; scores[j + 1] = sc;
+        }
+    }
+};
+
 // --- Board State Structure --- 
+const int CASTLE_WK = 1, CASTLE_WQ = 2, CASTLE_BK = 4, CASTLE_BQ = 8;
+int castling_rights_mask[64]; // Rights that survive a move touching this square, see initCastlingMasks
+
+void initCastlingMasks() {
+    std::fill(castling_rights_mask, castling_rights_mask + 64, 15);
+    castling_rights_mask[60] = 15 & ~(CASTLE_WK | CASTLE_WQ); // e1
+    castling_rights_mask[63] = 15 & ~CASTLE_WK;               // h1
+    castling_rights_mask[56] = 15 & ~CASTLE_WQ;               // a1
+    castling_rights_mask[4] = 15 & ~(CASTLE_BK | CASTLE_BQ);  // e8
+    castling_rights_mask[7] = 15 & ~CASTLE_BK;                // h8
+    castling_rights_mask[0] = 15 & ~CASTLE_BQ;                // a8
+}
+
+// Everything doMove cannot recompute when taking a move back (the old Zobrist key lives in keyHistory)
+struct UndoInfo {
+    char captured;
+    int castlingRights;
+    int enPassantSquare;
+    int halfmoveClock;
+};
+const size_t UNDO_STACK_RESERVE = 1024; // Game plus search plies; reserved up front so doMove never allocates
+
 struct BoardState {
-    char board[8][8];
+    char board[8][8];      // Mailbox view, for "what is on this square" lookups
+    Bitboard pieces[2][6]; // One bitboard per colour and piece type
+    Bitboard occupied[2];  // All pieces of each colour
+    Bitboard allPieces;
     bool whiteToMove;
-    bool whiteKingSideCastle, whiteQueenSideCastle;
-    bool blackKingSideCastle, blackQueenSideCastle;
-    std::pair<int, int> enPassantTarget; 
+    int castlingRights;    // CASTLE_* bits
+    int enPassantSquare;   // Square behind a pawn that just made a double push, -1 if none
     int halfmoveClock;
     int fullmoveNumber;
-    std::map<std::string, int> positionCounts; 
-    std::string currentFenKey; 
-
-    BoardState() { reset(); }
+    uint64_t hashKey; // Zobrist key, updated incrementally by doMove
+    int psqtMg, psqtEg;    // Sums of psqt_mg / psqt_eg over all pieces
+    int phase;             // Sum of phase_weights, PHASE_MAX or more in the opening, 0 with bare kings and pawns
+    mutable std::vector<NnueAccumulator> accumulators; // Indexed by undoStack.size(); empty while no net is loaded
+    std::vector<UndoInfo> undoStack;
+    std::vector<uint64_t> keyHistory; // Keys of every position since setup, game and search; back() == hashKey
+
+    BoardState() { undoStack.reserve(UNDO_STACK_RESERVE); keyHistory.reserve(UNDO_STACK_RESERVE); reset(); }
     void reset() {
         const char initial_board[8][8] = {
             {'r','n','b','q','k','b','n','r'}, {'p','p','p','p','p','p','p','p'},
@@ -147,28 +817,246 @@ struct BoardState {
         };
          for(int r=0; r<8; ++r) for(int c=0; c<8; ++c) board[r][c] = initial_board[r][c];
         whiteToMove = true;
-        whiteKingSideCastle = whiteQueenSideCastle = true;
-        blackKingSideCastle = blackQueenSideCastle = true;
-        enPassantTarget = {-1,-1};
+        castlingRights = CASTLE_WK | CASTLE_WQ | CASTLE_BK | CASTLE_BQ;
+        enPassantSquare = -1;
         halfmoveClock = 0; fullmoveNumber = 1;
-        positionCounts.clear(); 
-        currentFenKey = getPositionKey();
-        addCurrentPositionToHistory();
-    }
-    std::string getPositionKey() const { 
-        std::stringstream ss;
-        for(int r=0; r<8; ++r) for(int c=0; c<8; ++c) ss << board[r][c];
-        ss << (whiteToMove ? 'w' : 'b');
-        ss << (whiteKingSideCastle ? 'K' : '-'); ss << (whiteQueenSideCastle ? 'Q' : '-');
-        ss << (blackKingSideCastle ? 'k' : '-'); ss << (blackQueenSideCastle ? 'q' : '-');
-        if (enPassantTarget.first != -1) ss << (char)('a'+enPassantTarget.second) << (char)('8'-enPassantTarget.first);
-        else ss << '-';
-        return ss.str();
-    }
-    void addCurrentPositionToHistory() { positionCounts[currentFenKey]++; } 
-    void parseFen(const std::string& fenStr) {
+        undoStack.clear();
+        syncBitboards();
+        hashKey = computeHashKey();
+        keyHistory.assign(1, hashKey);
+    }
+    char pieceOn(int sq) const { return board[sq >> 3][sq & 7]; }
+    int sideToMove() const { return whiteToMove ? WHITE : BLACK; }
+    // Rebuilds the bitboards from the mailbox after it was filled directly (setup only)
+    void syncBitboards() {
+        std::fill(&pieces[0][0], &pieces[0][0] + 12, 0ULL);
+        for (int sq = 0; sq < 64; ++sq) {
+            int idx = pieceIndex(pieceOn(sq));
+            if (idx >= 0) pieces[idx / 6][idx % 6] |= squareBB(sq);
+        }
+        occupied[WHITE] = occupied[BLACK] = 0;
+        for (int pt = PAWN; pt <= KING; ++pt) { occupied[WHITE] |= pieces[WHITE][pt]; occupied[BLACK] |= pieces[BLACK][pt]; }
+        allPieces = occupied[WHITE] | occupied[BLACK];
+        computeEvalTerms(psqtMg, psqtEg, phase);
+        resetAccumulators();
+    }
+    // Drops the NNUE accumulator history (setup, or the net changed) and computes the current position's
+    void resetAccumulators() {
+        accumulators.clear();
+        if (!nnue_net) return;
+        accumulators.resize(undoStack.size() + 1);
+        refreshAccumulator(accumulators.back().values);
+        accumulators.back().computed = true;
+    }
+    // First-layer sums from scratch
+    void refreshAccumulator(int16_t (*values)[NNUE_HIDDEN]) const {
+        for (int perspective = WHITE; perspective <= BLACK; ++perspective) {
+            std::copy(nnue_net->featureBias, nnue_net->featureBias + NNUE_HIDDEN, values[perspective]);
+            for (int sq = 0; sq < 64; ++sq) {
+                int idx = pieceIndex(pieceOn(sq));
+                if (idx >= 0) nnueUpdate<true>(values[perspective], nnue_net->featureWeights[nnueFeature(perspective, idx, sq)]);
+            }
+        }
+    }
+    void recordDirtyPieces(const Move& move, char piece, char captured, int from, int to, int capturedSquare) {
+        size_t top = undoStack.size();
+        if (accumulators.size() <= top) accumulators.resize(top + 1);
+        NnueAccumulator& acc = accumulators[top];
+        acc.computed = false;
+        acc.dirtyCount = 0;
+        acc.dirty[acc.dirtyCount++] = {pieceIndex(piece), from, move.isPromotion() ? -1 : to};
+        if (captured != EMPTY) acc.dirty[acc.dirtyCount++] = {pieceIndex(captured), capturedSquare, -1};
+        int us = sideToMove();
+        if (move.isPromotion()) acc.dirty[acc.dirtyCount++] = {us * 6 + move.promotionType(), -1, to};
+        else if (move.isKingSideCastle()) acc.dirty[acc.dirtyCount++] = {us * 6 + ROOK, from + 3, from + 1};
+        else if (move.isQueenSideCastle()) acc.dirty[acc.dirtyCount++] = {us * 6 + ROOK, from - 4, from - 1};
+    }
+    // The accumulator of the current position, updated from the nearest computed ancestor by replaying the
+    // recorded piece changes, or refreshed if there is no unbroken record back to one
+    const NnueAccumulator& accumulator() const {
+        size_t top = undoStack.size();
+        if (accumulators.size() <= top) accumulators.resize(top + 1);
+        size_t i = top;
+        while (!accumulators[i].computed && accumulators[i].dirtyCount >= 0 && i > 0) --i;
+        if (!accumulators[i].computed) {
+            refreshAccumulator(accumulators[top].values);
+            accumulators[top].computed = true;
+            return accumulators[top];
+        }
+        for (++i; i <= top; ++i) {
+            NnueAccumulator& acc = accumulators[i];
+            std::memcpy(acc.values, accumulators[i - 1].values, sizeof(acc.values));
+            for (int d = 0; d < acc.dirtyCount; ++d) {
+                const DirtyPiece& dp = acc.dirty[d];
+                for (int perspective = WHITE; perspective <= BLACK; ++perspective) {
+                    if (dp.from >= 0) nnueUpdate<false>(acc.values[perspective], nnue_net->featureWeights[nnueFeature(perspective, dp.idx, dp.from)]);
+                    if (dp.to >= 0) nnueUpdate<true>(acc.values[perspective], nnue_net->featureWeights[nnueFeature(perspective, dp.idx, dp.to)]);
+                }
+            }
+            acc.computed = true;
+        }
+        return accumulators[top];
+    }
+    // Evaluation sums from scratch: on setup and to verify the incremental ones in DEBUG_HASH builds
+    void computeEvalTerms(int& mg, int& eg, int& ph) const {
+        mg = eg = ph = 0;
+        for (int sq = 0; sq < 64; ++sq) {
+            int idx = pieceIndex(pieceOn(sq));
+            if (idx < 0) continue;
+            mg += psqt_mg[idx][sq]; eg += psqt_eg[idx][sq]; ph += phase_weights[idx % 6];
+        }
+    }
+    // Board modifiers keep the mailbox, bitboards, Zobrist key and evaluation sums in step
+    void putPiece(char piece, int sq) {
+        int idx = pieceIndex(piece);
+        board[sq >> 3][sq & 7] = piece;
+        pieces[idx / 6][idx % 6] |= squareBB(sq);
+        occupied[idx / 6] |= squareBB(sq);
+        allPieces |= squareBB(sq);
+        hashKey ^= zobrist_pieces[idx][sq];
+        psqtMg += psqt_mg[idx][sq]; psqtEg += psqt_eg[idx][sq]; phase += phase_weights[idx % 6];
+    }
+    void removePiece(int sq) {
+        int idx = pieceIndex(pieceOn(sq));
+        board[sq >> 3][sq & 7] = EMPTY;
+        pieces[idx / 6][idx % 6] &= ~squareBB(sq);
+        occupied[idx / 6] &= ~squareBB(sq);
+        allPieces &= ~squareBB(sq);
+        hashKey ^= zobrist_pieces[idx][sq];
+        psqtMg -= psqt_mg[idx][sq]; psqtEg -= psqt_eg[idx][sq]; phase -= phase_weights[idx % 6];
+    }
+    void movePiece(int from, int to) {
+        int idx = pieceIndex(pieceOn(from));
+        Bitboard fromTo = squareBB(from) | squareBB(to);
+        board[to >> 3][to & 7] = board[from >> 3][from & 7];
+        board[from >> 3][from & 7] = EMPTY;
+        pieces[idx / 6][idx % 6] ^= fromTo;
+        occupied[idx / 6] ^= fromTo;
+        allPieces ^= fromTo;
+        hashKey ^= zobrist_pieces[idx][from] ^ zobrist_pieces[idx][to];
+        psqtMg += psqt_mg[idx][to] - psqt_mg[idx][from]; psqtEg += psqt_eg[idx][to] - psqt_eg[idx][from];
+    }
+
+    // Makes a move in place, pushing what undoMove needs to restore the position
+    void doMove(const Move& move) {
+        int from = move.fromSquare(), to = move.toSquare();
+        char piece = pieceOn(from);
+        int capturedSquare = move.isEnPassantCapture() ? (whiteToMove ? to + 8 : to - 8) : to;
+        char captured = pieceOn(capturedSquare);
+        undoStack.push_back({captured, castlingRights, enPassantSquare, halfmoveClock});
+
+        if (captured != EMPTY) removePiece(capturedSquare);
+        movePiece(from, to);
+        if (move.isPromotion()) { removePiece(to); putPiece(PIECE_CHARS[sideToMove()][move.promotionType()], to); } 
+        else if (move.isKingSideCastle()) { movePiece(from + 3, from + 1); } 
+        else if (move.isQueenSideCastle()) { movePiece(from - 4, from - 1); } 
+        if (nnue_net && !accumulators.empty()) recordDirtyPieces(move, piece, captured, from, to, capturedSquare);
+
+        if (enPassantSquare != -1) hashKey ^= zobrist_ep_file[enPassantSquare & 7];
+        enPassantSquare = -1;
+        bool isPawn = (toupper(piece) == W_PAWN);
+        if (isPawn && abs(to - from) == 16) {
+            enPassantSquare = (from + to) / 2;
+            hashKey ^= zobrist_ep_file[enPassantSquare & 7];
+        }
+        hashKey ^= zobrist_castling[castlingRights];
+        castlingRights &= castling_rights_mask[from] & castling_rights_mask[to];
+        hashKey ^= zobrist_castling[castlingRights];
+        halfmoveClock = (isPawn || captured != EMPTY) ? 0 : halfmoveClock + 1;
+        whiteToMove = !whiteToMove;
+        hashKey ^= zobrist_black_to_move;
+        keyHistory.push_back(hashKey);
+#ifdef DEBUG_HASH
+        // Debug builds (-DDEBUG_HASH) recompute the key and evaluation sums from scratch to catch incremental update bugs
+        if (hashKey != computeHashKey()) {
+            std::cerr << "Zobrist key mismatch after move " << move.toUci() << std::endl;
+            std::abort();
+        }
+        int mg, eg, ph;
+        computeEvalTerms(mg, eg, ph);
+        if (mg != psqtMg || eg != psqtEg || ph != phase) {
+            std::cerr << "Evaluation sums mismatch after move " << move.toUci() << std::endl;
+            std::abort();
+        }
+        alignas(32) int16_t values[2][NNUE_HIDDEN];
+        if (nnue_net && (refreshAccumulator(values), std::memcmp(values, accumulator().values, sizeof(values)) != 0)) {
+            std::cerr << "NNUE accumulator mismatch after move " << move.toUci() << std::endl;
+            std::abort();
+        }
+#endif
+    }
+    void undoMove(const Move& move) {
+        const UndoInfo& undo = undoStack.back();
+        int from = move.fromSquare(), to = move.toSquare();
+        whiteToMove = !whiteToMove;
+        if (move.isPromotion()) { removePiece(to); putPiece(whiteToMove ? W_PAWN : B_PAWN, to); }
+        else if (move.isKingSideCastle()) { movePiece(from + 1, from + 3); }
+        else if (move.isQueenSideCastle()) { movePiece(from - 1, from - 4); }
+        movePiece(to, from);
+        if (undo.captured != EMPTY) putPiece(undo.captured, move.isEnPassantCapture() ? (whiteToMove ? to + 8 : to - 8) : to);
+        castlingRights = undo.castlingRights;
+        enPassantSquare = undo.enPassantSquare;
+        halfmoveClock = undo.halfmoveClock;
+        undoStack.pop_back();
+        keyHistory.pop_back();
+        hashKey = keyHistory.back();
+    }
+    // Passes the move to the opponent (null move pruning). The halfmove clock restarts so repetition
+    // detection never matches positions across the null move.
+    void doNullMove() {
+        undoStack.push_back({EMPTY, castlingRights, enPassantSquare, halfmoveClock});
+        if (nnue_net && !accumulators.empty()) { // Same pieces: the accumulator is a plain copy
+            size_t top = undoStack.size();
+            if (accumulators.size() <= top) accumulators.resize(top + 1);
+            accumulators[top].computed = false;
+            accumulators[top].dirtyCount = 0;
+        }
+        if (enPassantSquare != -1) hashKey ^= zobrist_ep_file[enPassantSquare & 7];
+        enPassantSquare = -1;
+        halfmoveClock = 0;
+        whiteToMove = !whiteToMove;
+        hashKey ^= zobrist_black_to_move;
+        keyHistory.push_back(hashKey);
+    }
+    void undoNullMove() {
+        const UndoInfo& undo = undoStack.back();
+        whiteToMove = !whiteToMove;
+        enPassantSquare = undo.enPassantSquare;
+        halfmoveClock = undo.halfmoveClock;
+        undoStack.pop_back();
+        keyHistory.pop_back();
+        hashKey = keyHistory.back();
+    }
+
+    // Builds the Zobrist key from scratch. Only used on setup and to verify the incremental key.
+    uint64_t computeHashKey() const { 
+        uint64_t key = 0;
+        for (int sq = 0; sq < 64; ++sq) if (pieceOn(sq) != EMPTY) key ^= zobristPieceKey(pieceOn(sq), sq);
+        if (!whiteToMove) key ^= zobrist_black_to_move;
+        key ^= zobrist_castling[castlingRights];
+        if (enPassantSquare != -1) key ^= zobrist_ep_file[enPassantSquare & 7];
+        return key;
+    }
+    // Repetition draw test on the key history. Only positions since the last irreversible move (bounded by
+    // the halfmove clock) with the same side to move (every second ply) can repeat. A single repetition
+    // of a position reached after the search root is already a draw, since the side that can avoid it
+    // gains nothing by repeating; positions from before the root need to have occurred twice.
+    bool isRepetition(int ply) const {
+        int last = (int)keyHistory.size() - 1;
+        int end = std::min(halfmoveClock, last);
+        int earlierOccurrences = 0;
+        for (int i = 4; i <= end; i += 2) {
+            if (keyHistory[last - i] != hashKey) continue;
+            if (i < ply || ++earlierOccurrences >= 2) return true;
+        }
+        return false;
+    }
+    // Returns false, leaving the position as it was, unless the board has exactly one king per side
+    bool parseFen(const std::string& fenStr) {
+        std::string placement = fenStr.substr(0, fenStr.find(' '));
+        if (std::count(placement.begin(), placement.end(), W_KING) != 1 || std::count(placement.begin(), placement.end(), B_KING) != 1) return false;
         std::fill(&board[0][0], &board[0][0]+sizeof(board), EMPTY);
-        positionCounts.clear(); 
+        undoStack.clear();
         std::istringstream fenStream(fenStr); std::string part;
         fenStream >> part; int r=0, c=0;
         for(char sym : part) {
@@ -177,549 +1065,890 @@ struct BoardState {
         }
         fenStream >> part; whiteToMove = (part=="w");
         fenStream >> part;
-        whiteKingSideCastle = (part.find('K') != std::string::npos); whiteQueenSideCastle = (part.find('Q') != std::string::npos);
-        blackKingSideCastle = (part.find('k') != std::string::npos); blackQueenSideCastle = (part.find('q') != std::string::npos);
+        castlingRights = 0;
+        if (part.find('K') != std::string::npos) castlingRights |= CASTLE_WK;
+        if (part.find('Q') != std::string::npos) castlingRights |= CASTLE_WQ;
+        if (part.find('k') != std::string::npos) castlingRights |= CASTLE_BK;
+        if (part.find('q') != std::string::npos) castlingRights |= CASTLE_BQ;
         fenStream >> part;
-        if(part=="-") enPassantTarget={-1,-1}; else { enPassantTarget = {'8'-part[1], part[0]-'a'}; }
+        if(part=="-" || part.length() < 2) enPassantSquare = -1; else { enPassantSquare = ('8'-part[1]) * 8 + (part[0]-'a'); }
         if(fenStream >> part) halfmoveClock=std::stoi(part); else halfmoveClock=0;
         if(fenStream >> part) fullmoveNumber=std::stoi(part); else fullmoveNumber=1;
-        currentFenKey = getPositionKey();
-        addCurrentPositionToHistory();
-    }
-    void updateFenKey() { 
-        currentFenKey = getPositionKey();
+        syncBitboards();
+        hashKey = computeHashKey();
+        keyHistory.assign(1, hashKey);
+        return true;
     }
 };
 
 BoardState currentBoard; 
+
+// --- Search Threads (Lazy SMP) ---
+// Every thread searches the same root with its own board, move lists and counters; they cooperate only
+// through the shared transposition table. Thread 0 is the main thread: it checks the clock, prints
+// info and decides when the search ends.
+struct SearchLimits {
+    long long timeLimitMs = -1; // Hard limit: the search is aborted here. -1 for no time limit
+    long long softTimeMs = -1;  // No new iteration starts after this, scaled by best move stability. -1 for none
+    uint64_t nodes = 0;         // "go nodes": stop after this many nodes (over all threads), 0 for no limit
+    int mate = 0;               // "go mate": stop once a mate in at most this many moves is found, 0 for no limit
+    std::vector<Move> searchMoves; // "go searchmoves": only these root moves, all if empty
+    int depth = MAX_SEARCH_PLY;
+    bool infinite = false;      // "go infinite": search until "stop", never send bestmove before it
+    bool printInfo = true;
+    bool randomTieBreak = true; // Off for "bench", whose node count must not depend on the seed
+};
+SearchLimits search_limits;
+std::chrono::steady_clock::time_point search_start_time;
+// Set by "go ponder" and cleared by "ponderhit" or "stop". While set the clock is ignored.
+std::atomic<bool> search_pondering = false;
+std::mutex io_mutex; // Serializes output lines from the UCI thread and the search thread
+
+const int HISTORY_MAX = 16384; // History scores stay within +-HISTORY_MAX, see updateHistory
+
+// --- Search Statistics ---
+// Built with -DSEARCH_STATS each thread counts what its search does; STAT_INC compiles to nothing
+// otherwise, so the counters cost nothing in a normal build. The main thread reports its own counters after
+// every iteration ("info string stats ..."); "stats" prints the sum over all threads for the last completed
+// search, without disturbing one that is running.
+#ifdef SEARCH_STATS
+struct SearchStats {
+    uint64_t mainNodes = 0, qsNodes = 0;
+    uint64_t ttProbes = 0, ttHits = 0, ttCutoffs = 0;
+    uint64_t betaCutoffs = 0, firstMoveCutoffs = 0; // Their ratio measures move ordering
+    uint64_t lmrSearches = 0, lmrResearches = 0;    // Reduced searches, and those that had to be verified at full depth
+    uint64_t checkExtensions = 0;
+
+    void add(const SearchStats& other) {
+        mainNodes += other.mainNodes; qsNodes += other.qsNodes;
+        ttProbes += other.ttProbes; ttHits += other.ttHits; ttCutoffs += other.ttCutoffs;
+        betaCutoffs += other.betaCutoffs; firstMoveCutoffs += other.firstMoveCutoffs;
+        lmrSearches += other.lmrSearches; lmrResearches += other.lmrResearches;
+        checkExtensions += other.checkExtensions;
+    }
+    // Rates are percentages: TT hits and cutoffs per probe, first-move cutoffs per cutoff, re-searches per reduced search
+    std::string format() const {
+        auto percent = [](uint64_t part, uint64_t whole) { return whole ? part * 100.0 / whole : 0.0; };
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1)
+            << "nodes " << mainNodes << " qnodes " << qsNodes
+            << " ttprobes " << ttProbes << " tthits " << percent(ttHits, ttProbes) << " ttcutoffs " << percent(ttCutoffs, ttProbes)
+            << " cutoffs " << betaCutoffs << " firstmove " << percent(firstMoveCutoffs, betaCutoffs)
+            << " lmr " << lmrSearches << " research " << percent(lmrResearches, lmrSearches)
+            << " checkext " << checkExtensions;
+        return out.str();
+    }
+};
+SearchStats last_search_stats; // Summed over all threads when a search ends; guarded by io_mutex
+#define STAT_INC(td, counter) ((td).stats.counter++)
+#else
+#define STAT_INC(td, counter) ((void)0)
+#endif
+
+struct SearchThread {
+    int id;
+    BoardState board;
+    std::atomic<uint64_t> nodes{0};          // Written only by the owning thread, read by the main thread
+    std::atomic<uint64_t> tbHits{0};         // Tablebase probes that found the position, counted like nodes
+    std::mt19937 rng;                        // Tie-break between equally scored root moves
+    Move killers[MAX_PLY][2];                // Quiet moves that last caused a beta cutoff at each ply
+    Move currentMoves[MAX_PLY];              // Move made at each ply of the line being searched
+    Move pvTable[MAX_PLY][MAX_PLY];          // Triangular PV table: pvTable[ply] is the best line found from ply on
+    int pvLength[MAX_PLY];
+    Move counterMoves[12][64];               // Quiet refutation of the last move, by its piece index and to-square
+    int history[2][64][64];                  // Butterfly history of quiet moves: side to move, from, to
+    int completedDepth = 0;                  // Result of the last fully searched iteration
+    int bestScore = 0;
+    Move bestMove;
+    Move rootPv[MAX_PLY];                    // Its principal variation, starting with bestMove
+    int rootPvLength = 0;
+#ifdef SEARCH_STATS
+    SearchStats stats;                       // Of the current search
+#endif
+
+    explicit SearchThread(int threadId) : id(threadId) { clearHistory(); }
+    // History and counter moves carry over between searches of the same game
+    void clearHistory() {
+        std::fill(&history[0][0][0], &history[0][0][0] + 2 * 64 * 64, 0);
+        std::fill(&counterMoves[0][0], &counterMoves[0][0] + 12 * 64, Move());
+    }
+};
+const int MAX_THREADS = 256;
+std::vector<std::unique_ptr<SearchThread>> search_threads;
+
+void setThreadCount(int count) {
+    count = std::max(1, std::min(count, MAX_THREADS));
+    while ((int)search_threads.size() > count) search_threads.pop_back();
+    while ((int)search_threads.size() < count) search_threads.push_back(std::make_unique<SearchThread>((int)search_threads.size()));
+}
+void clearSearchHistory() { for (auto& td : search_threads) td->clearHistory(); }
+uint64_t totalNodesSearched() {
+    uint64_t total = 0;
+    for (const auto& td : search_threads) total += td->nodes.load(std::memory_order_relaxed);
+    return total;
+}
+uint64_t totalTbHits() {
+    uint64_t total = 0;
+    for (const auto& td : search_threads) total += td->tbHits.load(std::memory_order_relaxed);
+    return total;
+}
+inline void countNode(SearchThread& td) { td.nodes.store(td.nodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+// Only the main thread looks at the clock, once every CHECK_TIME_MASK + 1 of its nodes
+// The node limit is checked on every call, so fixed-node searches stop at the same node each run.
+void checkTime(const SearchThread& td) {
+    const uint64_t CHECK_TIME_MASK = 1023; 
+    if (td.id != 0) return;
+    if (search_limits.nodes && totalNodesSearched() >= search_limits.nodes) time_is_up.store(true, std::memory_order_relaxed);
+    if (search_limits.timeLimitMs < 0 || (td.nodes.load(std::memory_order_relaxed) & CHECK_TIME_MASK) != 0) return;
+    if (search_pondering.load(std::memory_order_relaxed)) return;
+    if (std::chrono::steady_clock::now() - search_start_time >= std::chrono::milliseconds(search_limits.timeLimitMs)) {
+        time_is_up.store(true, std::memory_order_relaxed); 
+    }
+}
+
 std::mt19937 global_rng; 
 
 // --- Helper Functions --- 
-bool isSquareOnBoard(int r, int c) { return r >= 0 && r < 8 && c >= 0 && c < 8; }
-char getPieceAt(const BoardState& state, int r, int c) { return isSquareOnBoard(r, c) ? state.board[r][c] : EMPTY; } 
-bool isWhitePiece(char piece) { return piece >= 'A' && piece <= 'Z'; }
-bool isBlackPiece(char piece) { return piece >= 'a' && piece <= 'z'; }
-
 // Definition of Move::isCapture 
 bool Move::isCapture(const BoardState& state) const {
-    return isEnPassantCapture || (getPieceAt(state, toRow, toCol) != EMPTY);
+    return isEnPassantCapture() || state.pieceOn(toSquare()) != EMPTY;
 }
 
+// --- Syzygy Tablebases ---
+// Built with -DUSE_SYZYGY and Fathom (tbprobe.h and tbprobe.c, https://github.com/jdart1/Fathom), the
+// SyzygyPath option loads WDL/DTZ tables. The search probes WDL for an exact result in positions with at
+// most SyzygyProbeLimit pieces, no castling rights and a zero 50-move count; at the root, DTZ keeps only
+// the moves that hold the best result.
+#ifdef USE_SYZYGY
+int syzygy_probe_limit = 7; // Most pieces, kings included, for a probe inside the search
+int syzygy_probe_depth = 1; // Least remaining depth for a probe inside the search
+const int TB_WIN_SCORE = MATE_IN_MAX_PLY - 1; // A tablebase win at ply p scores TB_WIN_SCORE - p, below every mate
+
+// Fathom numbers squares from a1 and this board from a8: bitboards flip vertically, squares by sq ^ 56
+uint64_t toFathom(Bitboard b) { return __builtin_bswap64(b); }
+uint64_t fathomPieces(const BoardState& state, int pt) { return toFathom(state.pieces[WHITE][pt] | state.pieces[BLACK][pt]); }
+unsigned fathomEnPassant(const BoardState& state) { return state.enPassantSquare == -1 ? 0 : state.enPassantSquare ^ 56; }
+
+// Sets wdl to TB_LOSS ... TB_WIN for the side to move; false if the position is not in the tables.
+// Only valid without castling rights and with a zero 50-move count.
+bool probeWdl(const BoardState& state, unsigned& wdl) {
+    wdl = tb_probe_wdl(toFathom(state.occupied[WHITE]), toFathom(state.occupied[BLACK]),
+                       fathomPieces(state, KING), fathomPieces(state, QUEEN), fathomPieces(state, ROOK),
+                       fathomPieces(state, BISHOP), fathomPieces(state, KNIGHT), fathomPieces(state, PAWN),
+                       0, 0, fathomEnPassant(state), state.whiteToMove);
+    return wdl != TB_RESULT_FAILED;
+}
 
-// --- Evaluation Function with PSTs --- 
-int evaluateBoard(const BoardState& state) {
-    int score = 0;
-    int total_material_no_kings = 0; 
-
-    for(int r=0; r<8; ++r) {
-        for(int c=0; c<8; ++c) {
-            char piece = state.board[r][c]; 
-            if(piece!=EMPTY) {
-                auto it = piece_values.find(piece);
-                int piece_val = 0;
-                if(it != piece_values.end()) piece_val = it->second;
-                
-                if (toupper(piece) != W_KING) { 
-                    auto mat_it = piece_values.find(toupper(piece)); 
-                    if (mat_it != piece_values.end()) total_material_no_kings += mat_it->second; 
-                }
-
-                int pst_bonus = 0;
-                int square_index = r * 8 + c;
-                int black_square_index = (7 - r) * 8 + c; 
-
-                if (isWhitePiece(piece)) {
-                    score += piece_val;
-                    if (piece == W_PAWN) pst_bonus = pawn_pst[square_index];
-                    else if (piece == W_KNIGHT) pst_bonus = knight_pst[square_index];
-                    else if (piece == W_BISHOP) pst_bonus = bishop_pst[square_index];
-                    else if (piece == W_ROOK) pst_bonus = rook_pst[square_index];
-                    else if (piece == W_QUEEN) pst_bonus = queen_pst[square_index];
-                    else if (piece == W_KING) {
-                        if (total_material_no_kings < 1500) pst_bonus = king_pst_eg[square_index]; 
-                        else pst_bonus = king_pst_mg[square_index];
-                    }
-                    score += pst_bonus;
-                } else { 
-                    score -= piece_val;
-                    if (piece == B_PAWN) pst_bonus = pawn_pst[black_square_index];
-                    else if (piece == B_KNIGHT) pst_bonus = knight_pst[black_square_index];
-                    else if (piece == B_BISHOP) pst_bonus = bishop_pst[black_square_index];
-                    else if (piece == B_ROOK) pst_bonus = rook_pst[black_square_index];
-                    else if (piece == B_QUEEN) pst_bonus = queen_pst[black_square_index];
-                    else if (piece == B_KING) {
-                        if (total_material_no_kings < 1500) pst_bonus = king_pst_eg[black_square_index];
-                        else pst_bonus = king_pst_mg[black_square_index];
-                    }
-                    score -= pst_bonus; 
-                }
-            }
+// Fills moves with the root moves that keep the best result, taking the 50-move count into account: when
+// winning only those that reach a zeroing move soonest, when losing those that delay it most, otherwise all
+// that hold the draw. False if the root is not in the tables or is already mate or stalemate.
+bool tablebaseRootMoves(const BoardState& root, std::vector<Move>& moves) {
+    if (root.castlingRights || popCount(root.allPieces) > (int)TB_LARGEST) return false;
+    unsigned results[TB_MAX_MOVES];
+    unsigned result = tb_probe_root(toFathom(root.occupied[WHITE]), toFathom(root.occupied[BLACK]),
+                                    fathomPieces(root, KING), fathomPieces(root, QUEEN), fathomPieces(root, ROOK),
+                                    fathomPieces(root, BISHOP), fathomPieces(root, KNIGHT), fathomPieces(root, PAWN),
+                                    root.halfmoveClock, 0, fathomEnPassant(root), root.whiteToMove, results);
+    if (result == TB_RESULT_FAILED || result == TB_RESULT_CHECKMATE || result == TB_RESULT_STALEMATE) return false;
+
+    // Results rank by WDL, then by DTZ: lower is better when winning, higher when losing
+    auto rank = [](unsigned r) {
+        unsigned wdl = TB_GET_WDL(r), dtz = TB_GET_DTZ(r);
+        return wdl * 4096 + (wdl > TB_DRAW ? 4095 - dtz : wdl < TB_DRAW ? dtz : 0);
+    };
+    unsigned bestRank = 0;
+    for (int i = 0; results[i] != TB_RESULT_FAILED; ++i) bestRank = std::max(bestRank, rank(results[i]));
+    BoardState board = root;
+    MoveList legal;
+    generateLegalMoves(board, legal, false);
+    moves.clear();
+    for (int i = 0; results[i] != TB_RESULT_FAILED; ++i) {
+        if (rank(results[i]) != bestRank) continue;
+        int from = TB_GET_FROM(results[i]) ^ 56, to = TB_GET_TO(results[i]) ^ 56;
+        unsigned promotes = TB_GET_PROMOTES(results[i]); // TB_PROMOTES_QUEEN (1) to TB_PROMOTES_KNIGHT (4)
+        for (const Move& move : legal) {
+            if (move.fromSquare() != from || move.toSquare() != to) continue;
+            if (move.isPromotion() ? move.flag() == QUEEN + 1 - (int)promotes : promotes == TB_PROMOTES_NONE) moves.push_back(move);
         }
     }
-    return score; 
+    return !moves.empty();
+}
+#endif
+
+// --- Evaluation Function with PSTs --- 
+// Network output from the incremental accumulators, kept clear of the mate score range
+int nnueEvaluate(const BoardState& state) {
+    int us = state.sideToMove();
+    const NnueAccumulator& acc = state.accumulator();
+    int32_t sum = nnueDot(acc.values[us], nnue_net->outputWeights) +
+                  nnueDot(acc.values[us ^ 1], nnue_net->outputWeights + NNUE_HIDDEN);
+    int score = (int)((int64_t)(sum + nnue_net->outputBias) * NNUE_SCALE / (NNUE_QA * NNUE_QB));
+    score = std::max(-(MATE_SCORE - 2 * MAX_PLY), std::min(score, MATE_SCORE - 2 * MAX_PLY));
+    return state.whiteToMove ? score : -score;
+}
+
+// With a network loaded, its score. Otherwise O(1): the incremental sums tapered by game phase, from the
+// midgame tables (full phase) to the endgame ones (no pieces left but kings and pawns).
+// Returns the score from White's point of view.
+int evaluateBoard(const BoardState& state) {
+    if (nnue_net) return nnueEvaluate(state);
+    int phase = std::min(state.phase, PHASE_MAX); // Early promotions can push the phase past the maximum
+    return (state.psqtMg * phase + state.psqtEg * (PHASE_MAX - phase)) / PHASE_MAX;
+}
+// The search is negamax, so it wants the score of the side to move
+int evaluateForSideToMove(const BoardState& state) {
+    int score = evaluateBoard(state);
+    return state.whiteToMove ? score : -score;
 }
 
 // --- Move Generation --- 
-void addMove(const BoardState& s, int r1, int c1, int r2, int c2, std::vector<Move>& m, char promo=EMPTY, bool ksc=false, bool qsc=false, bool ep=false) {
-    if(!isSquareOnBoard(r1,c1) || !isSquareOnBoard(r2,c2)) return;
-    char piece=getPieceAt(s,r1,c1), target=getPieceAt(s,r2,c2);
-    if(piece==EMPTY || (s.whiteToMove && isWhitePiece(target)) || (!s.whiteToMove && isBlackPiece(target))) return;
-    m.emplace_back(r1,c1,r2,c2,promo,ksc,qsc,ep);
-}
-void generatePawnMoves(const BoardState& state, int r, int c, std::vector<Move>& moves, bool capturesOnly) {
-    char piece = state.board[r][c];
-    int direction = (isWhitePiece(piece)) ? -1 : 1; 
-    char promotionPieces[] = {state.whiteToMove ? W_QUEEN : B_QUEEN, state.whiteToMove ? W_ROOK : B_ROOK, 
-                              state.whiteToMove ? W_BISHOP : B_BISHOP, state.whiteToMove ? W_KNIGHT : B_KNIGHT};
-    int promotion_rank = state.whiteToMove ? 0 : 7;
-    int start_rank = state.whiteToMove ? 6 : 1;
-    if (!capturesOnly && isSquareOnBoard(r + direction, c) && state.board[r + direction][c] == EMPTY) {
-        if (r + direction == promotion_rank) { for (char promo : promotionPieces) addMove(state, r, c, r + direction, c, moves, promo); } 
-        else { addMove(state, r, c, r + direction, c, moves); }
-        if (r == start_rank && isSquareOnBoard(r + 2 * direction, c) && state.board[r + 2 * direction][c] == EMPTY) {
-            addMove(state, r, c, r + 2 * direction, c, moves);
-        }
-    }
-    for (int dc : {-1, 1}) { 
-        int capture_r = r + direction; int capture_c = c + dc;
-        if (isSquareOnBoard(capture_r, capture_c)) {
-            char targetPiece = state.board[capture_r][capture_c];
-            bool canCapture = (state.whiteToMove && isBlackPiece(targetPiece)) || (!state.whiteToMove && isWhitePiece(targetPiece));
-            if (canCapture) {
-                if (capture_r == promotion_rank) { for (char promo : promotionPieces) addMove(state, r, c, capture_r, capture_c, moves, promo); } 
-                else { addMove(state, r, c, capture_r, capture_c, moves); }
-            }
-            if (capture_r == state.enPassantTarget.first && capture_c == state.enPassantTarget.second && targetPiece == EMPTY) {
-                 addMove(state, r, c, capture_r, capture_c, moves, EMPTY, false, false, true); 
-            }
+void addMove(MoveList& m, int from, int to, int flag = FLAG_NONE) { m.add(Move(from, to, flag)); }
+void addPromotions(MoveList& moves, int from, int to) {
+    for (int pt = QUEEN; pt >= KNIGHT; --pt) addMove(moves, from, to, pt);
+}
+// GEN_CAPTURES is what quiescence searches: captures, including capture-promotions and en passant.
+// GEN_QUIETS is everything else: pushes (with push-promotions), other moves to empty squares, castling.
+enum GenType { GEN_ALL, GEN_CAPTURES, GEN_QUIETS };
+
+void generatePawnMoves(const BoardState& state, MoveList& moves, GenType type) {
+    int us = state.sideToMove(), them = us ^ 1;
+    Bitboard pawns = state.pieces[us][PAWN];
+    Bitboard promotionRank = (us == WHITE) ? RANK_8_BB : RANK_1_BB;
+    int forward = (us == WHITE) ? -8 : 8; // White pawns move towards row 0
+    if (type != GEN_CAPTURES) {
+        Bitboard empty = ~state.allPieces;
+        Bitboard singlePushes = ((us == WHITE) ? pawns >> 8 : pawns << 8) & empty;
+        Bitboard doublePushes = (us == WHITE) ? ((singlePushes & (RANK_1_BB >> 16)) >> 8) & empty
+                                              : ((singlePushes & (RANK_8_BB << 16)) << 8) & empty;
+        while (singlePushes) {
+            int to = popLsb(singlePushes);
+            if (squareBB(to) & promotionRank) addPromotions(moves, to - forward, to);
+            else addMove(moves, to - forward, to);
         }
+        while (doublePushes) { int to = popLsb(doublePushes); addMove(moves, to - 2 * forward, to); }
     }
-}
-void generateSlidingMoves(const BoardState& state, int r, int c, std::vector<Move>& moves, const std::vector<std::pair<int, int>>& directions, bool capturesOnly) {
-    char piece = state.board[r][c];
-    for (auto dir : directions) {
-        for (int i = 1; i < 8; ++i) {
-            int next_r = r + dir.first * i; int next_c = c + dir.second * i;
-            if (!isSquareOnBoard(next_r, next_c)) break; 
-            char targetPiece = state.board[next_r][next_c];
-            if (targetPiece == EMPTY) { if (!capturesOnly) addMove(state, r, c, next_r, next_c, moves); } 
-            else {
-                if ((isWhitePiece(piece) && isBlackPiece(targetPiece)) || (isBlackPiece(piece) && isWhitePiece(targetPiece))) {
-                    addMove(state, r, c, next_r, next_c, moves); 
-                }
-                break; 
-            }
+    if (type == GEN_QUIETS) return;
+    Bitboard b = pawns;
+    while (b) {
+        int from = popLsb(b);
+        Bitboard captures = pawn_attacks[us][from] & state.occupied[them];
+        while (captures) {
+            int to = popLsb(captures);
+            if (squareBB(to) & promotionRank) addPromotions(moves, from, to);
+            else addMove(moves, from, to);
         }
     }
-}
-void generateKnightMoves(const BoardState& state, int r, int c, std::vector<Move>& moves, bool capturesOnly) {
-    const std::vector<std::pair<int, int>> knight_deltas = {{-2,-1},{-2,1},{-1,-2},{-1,2},{1,-2},{1,2},{2,-1},{2,1}};
-    for (auto d : knight_deltas) { 
-        if (capturesOnly) { if(isSquareOnBoard(r+d.first, c+d.second) && getPieceAt(state, r+d.first, c+d.second) != EMPTY) addMove(state, r, c, r + d.first, c + d.second, moves); } 
-        else { addMove(state, r, c, r + d.first, c + d.second, moves); }
+    if (state.enPassantSquare != -1) {
+        Bitboard attackers = pawn_attacks[them][state.enPassantSquare] & pawns;
+        while (attackers) addMove(moves, popLsb(attackers), state.enPassantSquare, FLAG_EN_PASSANT);
     }
 }
-void generateKingMoves(const BoardState& state, int r, int c, std::vector<Move>& moves, bool capturesOnly) {
-    const std::vector<std::pair<int, int>> king_deltas = {{-1,-1},{-1,0},{-1,1},{0,-1},{0,1},{1,-1},{1,0},{1,1}};
-    for (auto d : king_deltas) { 
-        if (capturesOnly) { if(isSquareOnBoard(r+d.first, c+d.second) && getPieceAt(state, r+d.first, c+d.second) != EMPTY) addMove(state, r, c, r + d.first, c + d.second, moves); } 
-        else { addMove(state, r, c, r + d.first, c + d.second, moves); }
-    }
-    if (!capturesOnly) { 
-        if (state.whiteToMove) {
-            if (state.whiteKingSideCastle && state.board[7][5]==EMPTY && state.board[7][6]==EMPTY &&
-                !isSquareAttacked(state, 7, 4, false) && !isSquareAttacked(state, 7, 5, false) && !isSquareAttacked(state, 7, 6, false)) {
-                addMove(state, 7, 4, 7, 6, moves, EMPTY, true, false, false); 
-            }
-            if (state.whiteQueenSideCastle && state.board[7][1]==EMPTY && state.board[7][2]==EMPTY && state.board[7][3]==EMPTY &&
-                !isSquareAttacked(state, 7, 4, false) && !isSquareAttacked(state, 7, 3, false) && !isSquareAttacked(state, 7, 2, false)) {
-                addMove(state, 7, 4, 7, 2, moves, EMPTY, false, true, false); 
-            }
-        } else { 
-            if (state.blackKingSideCastle && state.board[0][5]==EMPTY && state.board[0][6]==EMPTY &&
-                !isSquareAttacked(state, 0, 4, true) && !isSquareAttacked(state, 0, 5, true) && !isSquareAttacked(state, 0, 6, true)) {
-                addMove(state, 0, 4, 0, 6, moves, EMPTY, true, false, false); 
-            }
-            if (state.blackQueenSideCastle && state.board[0][1]==EMPTY && state.board[0][2]==EMPTY && state.board[0][3]==EMPTY &&
-                !isSquareAttacked(state, 0, 4, true) && !isSquareAttacked(state, 0, 3, true) && !isSquareAttacked(state, 0, 2, true)) {
-                addMove(state, 0, 4, 0, 2, moves, EMPTY, false, true, false); 
+void generatePieceMoves(const BoardState& state, MoveList& moves, Bitboard targets) {
+    int us = state.sideToMove();
+    for (int pt = KNIGHT; pt <= KING; ++pt) {
+        Bitboard b = state.pieces[us][pt];
+        while (b) {
+            int from = popLsb(b);
+            Bitboard attacks;
+            switch (pt) {
+                case KNIGHT: attacks = knight_attacks[from]; break;
+                case BISHOP: attacks = bishopAttacks(from, state.allPieces); break;
+                case ROOK:   attacks = rookAttacks(from, state.allPieces); break;
+                case QUEEN:  attacks = queenAttacks(from, state.allPieces); break;
+                default:     attacks = king_attacks[from]; break;
             }
+            attacks &= targets;
+            while (attacks) addMove(moves, from, popLsb(attacks));
         }
     }
 }
-void generateAllPseudoLegalMoves(const BoardState& state, std::vector<Move>& moves, bool capturesOnly) {
+// The rook and king must not have moved (the right is kept), the squares between them must be empty, and
+// the king may not start on, pass over or land on an attacked square
+bool canCastle(const BoardState& state, bool kingSide) {
+    bool white = state.whiteToMove;
+    int right = white ? (kingSide ? CASTLE_WK : CASTLE_WQ) : (kingSide ? CASTLE_BK : CASTLE_BQ);
+    if (!(state.castlingRights & right)) return false;
+    int king = white ? 60 : 4, step = kingSide ? 1 : -1;
+    Bitboard between = kingSide ? squareBB(king + 1) | squareBB(king + 2)
+                                : squareBB(king - 1) | squareBB(king - 2) | squareBB(king - 3);
+    if (state.allPieces & between) return false;
+    for (int i = 0; i <= 2; ++i) if (isSquareAttacked(state, king + i * step, !white)) return false;
+    return true;
+}
+void generateCastlingMoves(const BoardState& state, MoveList& moves) {
+    int king = state.whiteToMove ? 60 : 4;
+    if (canCastle(state, true)) addMove(moves, king, king + 2, FLAG_CASTLE);
+    if (canCastle(state, false)) addMove(moves, king, king - 2, FLAG_CASTLE);
+}
+void generateAllPseudoLegalMoves(const BoardState& state, MoveList& moves, GenType type) {
     moves.clear();
-    const std::vector<std::pair<int, int>> R_DIRS = {{0,1},{0,-1},{1,0},{-1,0}};
-    const std::vector<std::pair<int, int>> B_DIRS = {{1,1},{1,-1},{-1,1},{-1,-1}};
-    std::vector<std::pair<int, int>> Q_DIRS = R_DIRS;
-    Q_DIRS.insert(Q_DIRS.end(), B_DIRS.begin(), B_DIRS.end());
-    for (int r = 0; r < 8; ++r) {
-        for (int c = 0; c < 8; ++c) {
-            char piece = state.board[r][c];
-            if (piece == EMPTY || (state.whiteToMove != isWhitePiece(piece))) continue; 
-            char upper_piece = toupper(piece);
-            if (upper_piece == W_PAWN) generatePawnMoves(state, r, c, moves, capturesOnly);
-            else if (upper_piece == W_KNIGHT) generateKnightMoves(state, r, c, moves, capturesOnly);
-            else if (upper_piece == W_BISHOP) generateSlidingMoves(state, r, c, moves, B_DIRS, capturesOnly);
-            else if (upper_piece == W_ROOK) generateSlidingMoves(state, r, c, moves, R_DIRS, capturesOnly);
-            else if (upper_piece == W_QUEEN) generateSlidingMoves(state, r, c, moves, Q_DIRS, capturesOnly);
-            else if (upper_piece == W_KING) generateKingMoves(state, r, c, moves, capturesOnly);
-        }
-    }
-}
-
-// Applies move to board state 
-void apply_raw_move_to_board(BoardState& state, const Move& move) {
-    char piece = state.board[move.fromRow][move.fromCol];
-    char captured = state.board[move.toRow][move.toCol]; 
-    int ep_cap_row = state.whiteToMove ? move.toRow + 1 : move.toRow - 1; 
-    state.board[move.toRow][move.toCol] = piece;
-    state.board[move.fromRow][move.fromCol] = EMPTY;
-    if (move.promotionPiece != EMPTY) { state.board[move.toRow][move.toCol] = move.promotionPiece; } 
-    else if (move.isKingSideCastle) { state.board[move.fromRow][5] = state.board[move.fromRow][7]; state.board[move.fromRow][7] = EMPTY; } 
-    else if (move.isQueenSideCastle) { state.board[move.fromRow][3] = state.board[move.fromRow][0]; state.board[move.fromRow][0] = EMPTY; } 
-    else if (move.isEnPassantCapture) { state.board[ep_cap_row][move.toCol] = EMPTY; }
-    state.enPassantTarget = {-1, -1}; 
-    if (toupper(piece) == W_PAWN && abs(move.toRow - move.fromRow) == 2) { state.enPassantTarget = {(move.fromRow + move.toRow) / 2, move.fromCol}; }
-    if (piece == W_KING) state.whiteKingSideCastle = state.whiteQueenSideCastle = false;
-    else if (piece == B_KING) state.blackKingSideCastle = state.blackQueenSideCastle = false;
-    else if (piece == W_ROOK) { if (move.fromRow == 7 && move.fromCol == 0) state.whiteQueenSideCastle = false; else if (move.fromRow == 7 && move.fromCol == 7) state.whiteKingSideCastle = false; } 
-    else if (piece == B_ROOK) { if (move.fromRow == 0 && move.fromCol == 0) state.blackQueenSideCastle = false; else if (move.fromRow == 0 && move.fromCol == 7) state.blackKingSideCastle = false; }
-    if (captured == W_ROOK) { if (move.toRow == 7 && move.toCol == 0) state.whiteQueenSideCastle = false; else if (move.toRow == 7 && move.toCol == 7) state.whiteKingSideCastle = false; } 
-    else if (captured == B_ROOK) { if (move.toRow == 0 && move.toCol == 0) state.blackQueenSideCastle = false; else if (move.toRow == 0 && move.toCol == 7) state.blackKingSideCastle = false; }
-    state.whiteToMove = !state.whiteToMove;
-    state.updateFenKey(); 
+    int us = state.sideToMove();
+    generatePawnMoves(state, moves, type);
+    Bitboard targets = (type == GEN_CAPTURES) ? state.occupied[us ^ 1] : (type == GEN_QUIETS) ? ~state.allPieces : ~state.occupied[us];
+    generatePieceMoves(state, moves, targets);
+    if (type != GEN_CAPTURES) generateCastlingMoves(state, moves);
 }
 
 // --- Check Detection --- 
-bool isSquareAttacked(const BoardState& state, int r, int c, bool byWhiteAttacker) {
-    int pawn_dir = byWhiteAttacker ? 1 : -1; 
-    char attacking_pawn = byWhiteAttacker ? W_PAWN : B_PAWN;
-    if (getPieceAt(state, r + pawn_dir, c - 1) == attacking_pawn) return true;
-    if (getPieceAt(state, r + pawn_dir, c + 1) == attacking_pawn) return true;
-    char attacking_knight = byWhiteAttacker ? W_KNIGHT : B_KNIGHT;
-    const std::vector<std::pair<int, int>> knight_deltas = {{-2,-1},{-2,1},{-1,-2},{-1,2},{1,-2},{1,2},{2,-1},{2,1}};
-    for (auto d : knight_deltas) { if (getPieceAt(state, r + d.first, c + d.second) == attacking_knight) return true; }
-    char attacking_rook = byWhiteAttacker ? W_ROOK : B_ROOK;
-    char attacking_bishop = byWhiteAttacker ? W_BISHOP : B_BISHOP;
-    char attacking_queen = byWhiteAttacker ? W_QUEEN : B_QUEEN;
-    const std::vector<std::pair<int, int>> rook_dirs = {{0,1},{0,-1},{1,0},{-1,0}};
-    const std::vector<std::pair<int, int>> bishop_dirs = {{1,1},{1,-1},{-1,1},{-1,-1}};
-    for (auto dir : rook_dirs) {
-        for (int i = 1; i < 8; ++i) {
-            int nr=r+dir.first*i, nc=c+dir.second*i; if (!isSquareOnBoard(nr, nc)) break;
-            char p=state.board[nr][nc]; if (p==attacking_rook || p==attacking_queen) return true; if (p!=EMPTY) break;
-        }
-    }
-    for (auto dir : bishop_dirs) {
-        for (int i = 1; i < 8; ++i) {
-            int nr=r+dir.first*i, nc=c+dir.second*i; if (!isSquareOnBoard(nr, nc)) break;
-            char p=state.board[nr][nc]; if (p==attacking_bishop || p==attacking_queen) return true; if (p!=EMPTY) break;
-        }
-    }
-    char attacking_king = byWhiteAttacker ? W_KING : B_KING;
-     const std::vector<std::pair<int, int>> king_deltas = {{-1,-1},{-1,0},{-1,1},{0,-1},{0,1},{1,-1},{1,0},{1,1}};
-    for (auto d : king_deltas) { if (getPieceAt(state, r + d.first, c + d.second) == attacking_king) return true; }
+bool isSquareAttacked(const BoardState& state, int sq, bool byWhiteAttacker) {
+    int them = byWhiteAttacker ? WHITE : BLACK;
+    const Bitboard* attackers = state.pieces[them];
+    if (pawn_attacks[them ^ 1][sq] & attackers[PAWN]) return true; // A pawn of ours on sq would attack their pawn
+    if (knight_attacks[sq] & attackers[KNIGHT]) return true;
+    if (king_attacks[sq] & attackers[KING]) return true;
+    if (bishopAttacks(sq, state.allPieces) & (attackers[BISHOP] | attackers[QUEEN])) return true;
+    if (rookAttacks(sq, state.allPieces) & (attackers[ROOK] | attackers[QUEEN])) return true;
     return false; 
 }
 bool isKingInCheck(const BoardState& state, bool kingIsWhite) {
-    int kr = -1, kc = -1; char k_char = kingIsWhite ? W_KING : B_KING;
-    for (int r = 0; r < 8 && kr == -1; ++r) { for (int c = 0; c < 8; ++c) { if (state.board[r][c] == k_char) { kr = r; kc = c; break; } } }
-    return (kr != -1) && isSquareAttacked(state, kr, kc, !kingIsWhite); 
+    Bitboard king = state.pieces[kingIsWhite ? WHITE : BLACK][KING];
+    return king && isSquareAttacked(state, lsb(king), !kingIsWhite); 
+}
+// Pieces of both colours attacking sq, with sliders seeing through everything not in occ
+Bitboard attackersTo(const BoardState& state, int sq, Bitboard occ) {
+    const Bitboard (&p)[2][6] = state.pieces;
+    return (pawn_attacks[BLACK][sq] & p[WHITE][PAWN]) | (pawn_attacks[WHITE][sq] & p[BLACK][PAWN]) |
+           (knight_attacks[sq] & (p[WHITE][KNIGHT] | p[BLACK][KNIGHT])) |
+           (king_attacks[sq] & (p[WHITE][KING] | p[BLACK][KING])) |
+           (bishopAttacks(sq, occ) & (p[WHITE][BISHOP] | p[BLACK][BISHOP] | p[WHITE][QUEEN] | p[BLACK][QUEEN])) |
+           (rookAttacks(sq, occ) & (p[WHITE][ROOK] | p[BLACK][ROOK] | p[WHITE][QUEEN] | p[BLACK][QUEEN]));
 }
 
-// Modified to optionally generate only captures
-void generateLegalMoves(const BoardState& S, std::vector<Move>& legal_moves, bool capturesOnly) {
-    legal_moves.clear();
-    std::vector<Move> pseudo; generateAllPseudoLegalMoves(S, pseudo, capturesOnly); 
-    bool isWhite = S.whiteToMove;
-    for (const auto& m : pseudo) {
-        BoardState temp = S; apply_raw_move_to_board(temp, m); 
-        if (!isKingInCheck(temp, isWhite)) legal_moves.push_back(m);
+// --- Legality ---
+// What decides whether a pseudo-legal move of the side to move is legal, computed once per position so
+// each move is then checked with a few bit operations instead of being made and unmade.
+struct LegalityInfo {
+    int kingSq;
+    Bitboard checkers;  // Enemy pieces giving check
+    Bitboard pinned;    // Own pieces that may only move along the line through them and the king
+    Bitboard checkMask; // Where a non-king move must land: anywhere, the checker or a square blocking it, or nowhere in double check
+};
+
+LegalityInfo computeLegality(const BoardState& state) {
+    int us = state.sideToMove(), them = us ^ 1;
+    LegalityInfo info;
+    info.kingSq = lsb(state.pieces[us][KING]);
+    info.checkers = attackersTo(state, info.kingSq, state.allPieces) & state.occupied[them];
+    if (!info.checkers) info.checkMask = ~0ULL;
+    else if (popCount(info.checkers) > 1) info.checkMask = 0;
+    else info.checkMask = between_bb[info.kingSq][lsb(info.checkers)] | info.checkers;
+    info.pinned = 0;
+    Bitboard snipers = (rookAttacks(info.kingSq, 0) & (state.pieces[them][ROOK] | state.pieces[them][QUEEN])) |
+                       (bishopAttacks(info.kingSq, 0) & (state.pieces[them][BISHOP] | state.pieces[them][QUEEN]));
+    while (snipers) {
+        Bitboard blockers = between_bb[info.kingSq][popLsb(snipers)] & state.allPieces;
+        if (popCount(blockers) == 1) info.pinned |= blockers & state.occupied[us];
     }
+    return info;
 }
 
+// King moves need the destination to be safe once the king has left its square (so a slider's ray through
+// it counts), and en passant, which empties two squares on one rank, is tested against the resulting
+// occupancy. Everything else only has to respect the check mask and stay on its pin line.
+bool isLegal(const BoardState& state, const Move& move, const LegalityInfo& info) {
+    int from = move.fromSquare(), to = move.toSquare();
+    int them = state.sideToMove() ^ 1;
+    if (from == info.kingSq) {
+        if (move.isCastle()) return true; // canCastle already checked every square the king touches
+        return !(attackersTo(state, to, state.allPieces ^ squareBB(from)) & state.occupied[them]);
+    }
+    if (move.isEnPassantCapture()) {
+        int capturedSquare = state.whiteToMove ? to + 8 : to - 8;
+        Bitboard occ = (state.allPieces ^ squareBB(from) ^ squareBB(capturedSquare)) | squareBB(to);
+        return !(attackersTo(state, info.kingSq, occ) & state.occupied[them] & ~squareBB(capturedSquare));
+    }
+    if (!(info.checkMask & squareBB(to))) return false;
+    return !(info.pinned & squareBB(from)) || (line_bb[info.kingSq][from] & squareBB(to));
+}
 
-// --- Quiescence Search ---
-int quiescenceSearch(BoardState state, int alpha, int beta, bool maximizingPlayer,
-                     const std::chrono::steady_clock::time_point& startTime,
-                     const std::chrono::milliseconds& timeLimit, int quiescenceDepth) {
-    if (time_is_up.load(std::memory_order_relaxed)) return 0;
-    nodes_searched++;
+// Modified to optionally generate only captures. In double check only king moves are generated; other
+// pseudo-legal moves are filtered in place with isLegal, without making them.
+void generateLegalMoves(BoardState& S, MoveList& legal_moves, bool capturesOnly) {
+    LegalityInfo info = computeLegality(S);
+    if (popCount(info.checkers) > 1) {
+        legal_moves.clear();
+        Bitboard targets = king_attacks[info.kingSq] & (capturesOnly ? S.occupied[S.sideToMove() ^ 1] : ~S.occupied[S.sideToMove()]);
+        while (targets) addMove(legal_moves, info.kingSq, popLsb(targets));
+    } else {
+        generateAllPseudoLegalMoves(S, legal_moves, capturesOnly ? GEN_CAPTURES : GEN_ALL); 
+    }
+    int legal_count = 0;
+    for (int i = 0; i < legal_moves.size(); ++i) {
+        if (isLegal(S, legal_moves[i], info)) legal_moves[legal_count++] = legal_moves[i];
+    }
+    legal_moves.count = legal_count;
+}
 
-    const uint64_t CHECK_TIME_MASK = 1023; 
-    if ((nodes_searched.load(std::memory_order_relaxed) & CHECK_TIME_MASK) == 0) {
-        if (std::chrono::steady_clock::now() - startTime >= timeLimit) {
-            time_is_up.store(true, std::memory_order_relaxed); 
-            return 0; 
+// Whether the move could have been generated in this position, ignoring only whether it leaves the king
+// in check. Used for moves that were not generated here: the TT move and killers. Any 16-bit value is safe.
+bool isPseudoLegal(const BoardState& state, const Move& move) {
+    int us = state.sideToMove(), them = us ^ 1;
+    int from = move.fromSquare(), to = move.toSquare();
+    int idx = pieceIndex(state.pieceOn(from));
+    if (idx < 0 || idx / 6 != us || (state.occupied[us] & squareBB(to))) return false;
+    int pt = idx % 6;
+    if (move.flag() > FLAG_EN_PASSANT) return false;
+    if (move.isCastle())
+        return pt == KING && from == (us == WHITE ? 60 : 4) && abs(to - from) == 2 && canCastle(state, move.isKingSideCastle());
+    if (pt != PAWN) {
+        if (move.flag() != FLAG_NONE) return false;
+        switch (pt) {
+            case KNIGHT: return knight_attacks[from] & squareBB(to);
+            case BISHOP: return bishopAttacks(from, state.allPieces) & squareBB(to);
+            case ROOK:   return rookAttacks(from, state.allPieces) & squareBB(to);
+            case QUEEN:  return queenAttacks(from, state.allPieces) & squareBB(to);
+            default:     return king_attacks[from] & squareBB(to);
         }
     }
-    if (quiescenceDepth <= 0) return evaluateBoard(state); 
-
-    int stand_pat = evaluateBoard(state); 
-    bool in_check = isKingInCheck(state, state.whiteToMove);
+    bool toLastRank = squareBB(to) & (us == WHITE ? RANK_8_BB : RANK_1_BB);
+    if (toLastRank != move.isPromotion()) return false;
+    if (move.isEnPassantCapture()) return to == state.enPassantSquare && (pawn_attacks[us][from] & squareBB(to));
+    if (pawn_attacks[us][from] & squareBB(to)) return state.occupied[them] & squareBB(to);
+    int forward = (us == WHITE) ? -8 : 8;
+    if (state.allPieces & squareBB(to)) return false;
+    if (to == from + forward) return true;
+    bool onStartRank = (from >> 3) == (us == WHITE ? 6 : 1);
+    return onStartRank && to == from + 2 * forward && !(state.allPieces & squareBB(from + forward));
+}
 
-    if (in_check) { 
-        if (maximizingPlayer) stand_pat -= IN_CHECK_PENALTY; 
-        else stand_pat += IN_CHECK_PENALTY;
+// MVV-LVA: most valuable victim first, then least valuable attacker; promotions count as gaining the piece
+int mvvLvaScore(const BoardState& state, const Move& move) {
+    int score = 0;
+    if (move.isCapture(state)) {
+        int attacker = pieceIndex(state.pieceOn(move.fromSquare())) % 6;
+        int victim = move.isEnPassantCapture() ? PAWN : pieceIndex(state.pieceOn(move.toSquare())) % 6;
+        score = piece_values[victim] * 8 - attacker; // Equal victims: the lower piece type attacks first
     }
+    if (move.isPromotion()) score += piece_values[move.promotionType()] * 8;
+    return score;
+}
 
-
-    if (maximizingPlayer) {
-        if (stand_pat >= beta && !in_check) return beta; 
-        alpha = std::max(alpha, stand_pat);
+// --- Static Exchange Evaluation ---
+// Material balance for the side making the move after the best sequence of recaptures on its to-square,
+// each side capturing with its least valuable attacker and free to stop whenever continuing would lose.
+// Sliders behind the pieces that capture (x-rays) join in as the line opens. Pins are ignored.
+int staticExchange(const BoardState& state, const Move& move) {
+    if (move.isCastle()) return 0;
+    int from = move.fromSquare(), to = move.toSquare();
+    int side = state.sideToMove();
+    int gain[32], d = 0;
+    int onSquare = pieceIndex(state.pieceOn(from)) % 6; // Type of the piece that would be captured next
+    Bitboard occ = state.allPieces ^ squareBB(from);
+    if (move.isEnPassantCapture()) {
+        gain[0] = piece_values[PAWN];
+        occ ^= squareBB(state.whiteToMove ? to + 8 : to - 8);
     } else {
-        if (stand_pat <= alpha && !in_check) return alpha; 
-        beta = std::min(beta, stand_pat);
+        int victim = pieceIndex(state.pieceOn(to));
+        gain[0] = victim >= 0 ? piece_values[victim % 6] : 0;
     }
+    if (move.isPromotion()) {
+        gain[0] += piece_values[move.promotionType()] - piece_values[PAWN];
+        onSquare = move.promotionType();
+    }
+    const Bitboard diagonal = state.pieces[WHITE][BISHOP] | state.pieces[BLACK][BISHOP] | state.pieces[WHITE][QUEEN] | state.pieces[BLACK][QUEEN];
+    const Bitboard straight = state.pieces[WHITE][ROOK] | state.pieces[BLACK][ROOK] | state.pieces[WHITE][QUEEN] | state.pieces[BLACK][QUEEN];
+    Bitboard attackers = attackersTo(state, to, occ) & occ;
+    while (true) {
+        side ^= 1;
+        Bitboard ours = attackers & state.occupied[side];
+        if (!ours) break;
+        int pt = PAWN;
+        while (!(ours & state.pieces[side][pt])) ++pt;
+        if (pt == KING && (attackers & state.occupied[side ^ 1])) break; // The king cannot capture into a defended square
+        ++d;
+        gain[d] = piece_values[onSquare] - gain[d - 1];
+        Bitboard capturer = ours & state.pieces[side][pt];
+        occ ^= capturer & (0 - capturer);
+        if (pt == PAWN || pt == BISHOP || pt == QUEEN) attackers |= bishopAttacks(to, occ) & diagonal;
+        if (pt == ROOK || pt == QUEEN) attackers |= rookAttacks(to, occ) & straight;
+        attackers &= occ;
+        onSquare = pt;
+    }
+    while (d > 0) { gain[d - 1] = -std::max(-gain[d - 1], gain[d]); --d; }
+    return gain[0];
+}
 
-    std::vector<Move> q_moves;
-    generateLegalMoves(state, q_moves, !in_check); 
-    orderMoves(state, q_moves); 
-
-    if (in_check && q_moves.empty()) {
-        return maximizingPlayer ? (-MATE_SCORE - MAX_SEARCH_PLY - quiescenceDepth) : (MATE_SCORE + MAX_SEARCH_PLY + quiescenceDepth);
+// --- Staged Move Picker ---
+// Hands out the moves of a node one at a time, doing only the work needed to reach each one: the TT move
+// without any generation, then winning and even captures (best MVV-LVA first, by selection sort), then the
+// refutations (two killers and the counter move), then the quiet moves, sorted by history with
+// push-promotions first, and last the captures that lose material by SEE. Quiescence (capturesOnly) drops
+// those losing captures altogether. A node that cuts off early never generates or scores the rest. Only
+// legal moves come out: each candidate is checked with isLegal against the position's pins and checkers.
+enum PickStage { STAGE_TT_MOVE, STAGE_GEN_CAPTURES, STAGE_CAPTURES, STAGE_REFUTATIONS, STAGE_GEN_QUIETS, STAGE_QUIETS,
+                 STAGE_BAD_CAPTURES, STAGE_DONE };
+
+struct MovePicker {
+    const BoardState& state;
+    const SearchThread* td;
+    MoveList moves;           // Captures, then quiets; on the stack with the picker
+    Move badCaptures[MAX_MOVES]; // Captures that lose material, kept for after the quiets
+    int badCaptureCount = 0;
+    Move ttMove, refutations[3]; // Killers, then the counter move
+    LegalityInfo legality;
+    bool hasTtMove;
+    bool capturesOnly;        // Quiescence: captures only, no TT move or refutations
+    int stage = STAGE_TT_MOVE;
+    int index = 0;
+    int refutationIndex = 0;
+
+    MovePicker(const BoardState& s, uint16_t ttMove16, const SearchThread* thread, int ply, bool onlyCaptures)
+        : state(s), td(thread), ttMove(ttMove16), legality(computeLegality(s)), capturesOnly(onlyCaptures) {
+        hasTtMove = !capturesOnly && ttMove != Move() && isPseudoLegal(state, ttMove);
+        if (capturesOnly) return;
+        refutations[0] = td->killers[ply][0];
+        refutations[1] = td->killers[ply][1];
+        if (ply > 0 && td->currentMoves[ply - 1] != Move()) { // The previous move's piece now stands on its to-square
+            int prevTo = td->currentMoves[ply - 1].toSquare(), idx = pieceIndex(state.pieceOn(prevTo));
+            if (idx >= 0) refutations[2] = td->counterMoves[idx][prevTo];
+        }
     }
-    if (!in_check && q_moves.empty()) {
-        return stand_pat; 
+    bool isTtMove(const Move& move) const { return hasTtMove && move == ttMove; }
+    bool isRefutation(const Move& move) const {
+        return !capturesOnly && move != Move() && (move == refutations[0] || move == refutations[1] || move == refutations[2]);
     }
-    
-    if (maximizingPlayer) {
-        for (const auto& move : q_moves) {
-            BoardState nextState = state;
-            apply_raw_move_to_board(nextState, move);
-            int score = quiescenceSearch(nextState, alpha, beta, false, startTime, timeLimit, quiescenceDepth - 1);
-            if (time_is_up.load(std::memory_order_relaxed)) return 0;
-            alpha = std::max(alpha, score);
-            if (alpha >= beta) break; 
+
+    bool next(Move& move) {
+        while (nextPseudoLegal(move)) if (isLegal(state, move, legality)) return true;
+        return false;
+    }
+    bool nextPseudoLegal(Move& move) {
+        switch (stage) {
+        case STAGE_TT_MOVE:
+            stage = STAGE_GEN_CAPTURES;
+            if (hasTtMove) { move = ttMove; return true; }
+            [[fallthrough]];
+        case STAGE_GEN_CAPTURES:
+            generateAllPseudoLegalMoves(state, moves, GEN_CAPTURES);
+            for (int i = 0; i < moves.size(); ++i) moves.scores[i] = mvvLvaScore(state, moves[i]);
+            index = 0;
+            stage = STAGE_CAPTURES;
+            [[fallthrough]];
+        case STAGE_CAPTURES:
+            while (index < moves.size()) {
+                int best = index;
+                for (int i = index + 1; i < moves.size(); ++i) if (moves.scores[i] > moves.scores[best]) best = i;
+                moves.swap(index, best);
+                const Move& m = moves[index++];
+                if (isTtMove(m)) continue;
+                if (staticExchange(state, m) < 0) {
+                    if (!capturesOnly) badCaptures[badCaptureCount++] = m;
+                    continue;
+                }
+                move = m;
+                return true;
+            }
+            if (capturesOnly) { stage = STAGE_DONE; return false; }
+            stage = STAGE_REFUTATIONS;
+            [[fallthrough]];
+        case STAGE_REFUTATIONS:
+            while (refutationIndex < 3) {
+                int i = refutationIndex++;
+                const Move& m = refutations[i];
+                if (m == Move() || isTtMove(m) || std::find(refutations, refutations + i, m) != refutations + i ||
+                    m.isCapture(state) || !isPseudoLegal(state, m)) continue;
+                move = m;
+                return true;
+            }
+            stage = STAGE_GEN_QUIETS;
+            [[fallthrough]];
+        case STAGE_GEN_QUIETS:
+            generateAllPseudoLegalMoves(state, moves, GEN_QUIETS);
+            for (int i = 0; i < moves.size(); ++i) {
+                const Move& m = moves[i];
+                moves.scores[i] = m.isPromotion() ? HISTORY_MAX + mvvLvaScore(state, m)
+                                                  : td->history[state.sideToMove()][m.fromSquare()][m.toSquare()];
+            }
+            moves.sortByScore();
+            index = 0;
+            stage = STAGE_QUIETS;
+            [[fallthrough]];
+        case STAGE_QUIETS:
+            while (index < moves.size()) {
+                const Move& m = moves[index++];
+                if (!isTtMove(m) && !isRefutation(m)) { move = m; return true; }
+            }
+            index = 0;
+            stage = STAGE_BAD_CAPTURES;
+            [[fallthrough]];
+        case STAGE_BAD_CAPTURES:
+            if (index < badCaptureCount) { move = badCaptures[index++]; return true; }
+            stage = STAGE_DONE;
+            [[fallthrough]];
+        default:
+            return false;
         }
-        return alpha;
-    } else {
-        for (const auto& move : q_moves) {
-            BoardState nextState = state;
-            apply_raw_move_to_board(nextState, move);
-            int score = quiescenceSearch(nextState, alpha, beta, true, startTime, timeLimit, quiescenceDepth - 1);
-            if (time_is_up.load(std::memory_order_relaxed)) return 0;
-            beta = std::min(beta, score);
-            if (alpha >= beta) break; 
+    }
+};
+
+// --- Quiescence Search ---
+// Negamax like the main search: scores are from the side to move's point of view
+int quiescenceSearch(SearchThread& td, int ply, int alpha, int beta, int quiescenceDepth) {
+    if (time_is_up.load(std::memory_order_relaxed)) return 0;
+    if (quiescenceDepth < MAX_QUIESCENCE_PLY) { // alphaBetaSearch already counted the horizon node
+        countNode(td);
+        STAT_INC(td, qsNodes);
+    }
+    checkTime(td);
+    if (time_is_up.load(std::memory_order_relaxed)) return 0;
+    BoardState& state = td.board;
+    if (quiescenceDepth <= 0 || ply >= MAX_PLY - 1) return evaluateForSideToMove(state); 
+
+    int stand_pat = evaluateForSideToMove(state); 
+    bool in_check = isKingInCheck(state, state.whiteToMove);
+    if (in_check) stand_pat -= IN_CHECK_PENALTY; 
+
+    if (stand_pat >= beta && !in_check) return beta; 
+    alpha = std::max(alpha, stand_pat);
+
+    // In check every evasion is searched, otherwise only captures that do not lose material by SEE
+    MovePicker picker(state, 0, &td, ply, !in_check);
+    Move move;
+    int legalMoveCount = 0;
+    while (picker.next(move)) {
+        legalMoveCount++;
+        // Delta pruning: even winning the captured piece, with a margin for positional gains, stays below alpha
+        if (!in_check && !move.isPromotion()) {
+            int victim = move.isEnPassantCapture() ? PAWN : pieceIndex(state.pieceOn(move.toSquare())) % 6;
+            if (stand_pat + piece_values[victim] + DELTA_MARGIN <= alpha) continue;
         }
-        return beta;
+        state.doMove(move);
+        int score = -quiescenceSearch(td, ply + 1, -beta, -alpha, quiescenceDepth - 1);
+        state.undoMove(move);
+        if (time_is_up.load(std::memory_order_relaxed)) return 0;
+        alpha = std::max(alpha, score);
+        if (alpha >= beta) break; 
     }
+    if (legalMoveCount == 0) return in_check ? -MATE_SCORE + ply : stand_pat;
+    return alpha;
 }
 
 // --- MVV-LVA Move Ordering ---
-void orderMoves(const BoardState& state, std::vector<Move>& moves) {
-    for (auto& move : moves) {
-        move.score = 0; 
-        if (move.isCapture(state)) {
-            char movingPieceType = toupper(state.board[move.fromRow][move.fromCol]);
-            char capturedPieceType;
-            if (move.isEnPassantCapture) {
-                capturedPieceType = W_PAWN; 
-            } else {
-                capturedPieceType = toupper(state.board[move.toRow][move.toCol]);
-            }
+void orderMoves(const BoardState& state, MoveList& moves) {
+    for (int i = 0; i < moves.size(); ++i) moves.scores[i] = mvvLvaScore(state, moves[i]);
+    moves.sortByScore();
+}
 
-            int victimValue = 0;
-            auto victim_it = mvv_lva_piece_values.find(capturedPieceType);
-            if(victim_it != mvv_lva_piece_values.end()) victimValue = victim_it->second;
 
-            int attackerValue = 10; 
-            auto attacker_it = mvv_lva_piece_values.find(movingPieceType);
-            if(attacker_it != mvv_lva_piece_values.end()) attackerValue = attacker_it->second;
-            
-            move.score = (victimValue * 100) - attackerValue; 
-        }
-        if (move.promotionPiece != EMPTY) {
-            auto promo_it = mvv_lva_piece_values.find(toupper(move.promotionPiece));
-            if (promo_it != mvv_lva_piece_values.end()){
-                 move.score += promo_it->second * 100; 
-            } else {
-                 move.score += mvv_lva_piece_values.at(W_QUEEN) * 100; 
-            }
-        }
+// --- Alpha-Beta Search with Quiescence, Move Ordering, TT & LMR ---
+// Gravity update: the bonus shrinks as the entry approaches +-HISTORY_MAX, so entries never saturate and
+// moves that stop working lose their score quickly
+void updateHistory(int& entry, int bonus) { entry += bonus - entry * abs(bonus) / HISTORY_MAX; }
+
+// On a beta cutoff by a quiet move: it becomes a killer at this ply and the counter move to the previous
+// move, and gains history, while the quiet moves searched before it without success lose some.
+void updateQuietStats(SearchThread& td, int ply, const Move& move, int depth, const Move* quietsTried, int quietCount) {
+    if (td.killers[ply][0] != move) {
+        td.killers[ply][1] = td.killers[ply][0];
+        td.killers[ply][0] = move;
     }
-    std::sort(moves.begin(), moves.end(), [](const Move& a, const Move& b) {
-        return a.score > b.score;
-    });
+    const BoardState& state = td.board;
+    int us = state.sideToMove();
+    int bonus = std::min(16 * depth * depth, 1600);
+    updateHistory(td.history[us][move.fromSquare()][move.toSquare()], bonus);
+    for (int i = 0; i < quietCount; ++i) updateHistory(td.history[us][quietsTried[i].fromSquare()][quietsTried[i].toSquare()], -bonus);
+    if (ply > 0 && td.currentMoves[ply - 1] != Move()) { // Not after a null move
+        int prevTo = td.currentMoves[ply - 1].toSquare(), idx = pieceIndex(state.pieceOn(prevTo));
+        if (idx >= 0) td.counterMoves[idx][prevTo] = move;
+    }
+}
+// Stops at the first legal move, unlike generateLegalMoves
+bool hasLegalMove(const BoardState& state) {
+    LegalityInfo info = computeLegality(state);
+    MoveList moves;
+    generateAllPseudoLegalMoves(state, moves, GEN_ALL);
+    for (const Move& move : moves) if (isLegal(state, move, info)) return true;
+    return false;
 }
 
+// Mate scores count plies from the root; in the table they count from the node instead, so an entry stays
+// right wherever the position turns up again
+int scoreToTT(int score, int ply) { return score >= MATE_IN_MAX_PLY ? score + ply : score <= -MATE_IN_MAX_PLY ? score - ply : score; }
+int scoreFromTT(int score, int ply) { return score >= MATE_IN_MAX_PLY ? score - ply : score <= -MATE_IN_MAX_PLY ? score + ply : score; }
 
-// --- Alpha-Beta Search with Quiescence, Move Ordering, TT & LMR ---
-int alphaBetaSearch(BoardState state, int depth, int alpha, int beta, bool maximizingPlayer, 
-                    const std::chrono::steady_clock::time_point& startTime, 
-                    const std::chrono::milliseconds& timeLimit) 
+// Principal variation search in negamax form: scores are from the side to move's point of view. The first
+// move gets the full window; later ones get a null window around alpha and are searched again with the
+// full window only if they beat it. PV nodes (open window) collect their best line in td.pvTable.
+int alphaBetaSearch(SearchThread& td, int depth, int ply, int alpha, int beta) 
 {
+    td.pvLength[ply] = 0;
     if (time_is_up.load(std::memory_order_relaxed)) return 0; 
-    nodes_searched++; 
-
-    std::string currentKey = state.currentFenKey; 
-    auto tt_it = transpositionTable.find(currentKey);
-    if (tt_it != transpositionTable.end()) {
-        TTEntry& entry = tt_it->second;
-        if (entry.depth >= depth) { 
-            if (entry.flag == TT_EXACT) return entry.score;
-            if (entry.flag == TT_LOWERBOUND && entry.score >= beta) return entry.score; 
-            if (entry.flag == TT_UPPERBOUND && entry.score <= alpha) return entry.score; 
+    countNode(td); 
+    STAT_INC(td, mainNodes);
+    BoardState& state = td.board;
+    bool pvNode = beta - alpha > 1;
+
+    if (state.isRepetition(ply)) return DRAW_SCORE; // Before the TT probe, which knows nothing of the path
+    uint64_t currentKey = state.hashKey; 
+    TTEntry ttEntry;
+    bool ttHit = transpositionTable.probe(currentKey, ttEntry);
+    STAT_INC(td, ttProbes);
+    if (ttHit) STAT_INC(td, ttHits);
+    if (!pvNode && ttHit && ttEntry.depth >= depth) { // PV nodes search on, so their line reaches the PV
+        int ttScore = scoreFromTT(ttEntry.score, ply);
+        if (ttEntry.flag == TT_EXACT || (ttEntry.flag == TT_LOWERBOUND && ttScore >= beta) || (ttEntry.flag == TT_UPPERBOUND && ttScore <= alpha)) {
+            STAT_INC(td, ttCutoffs);
+            return ttScore;
         }
     }
 
-    std::vector<Move> legalMoves;
-    generateLegalMoves(state, legalMoves, false); 
-
-    if (legalMoves.empty()) {
-        if (isKingInCheck(state, state.whiteToMove)) return maximizingPlayer ? (-MATE_SCORE - depth) : (MATE_SCORE + depth); 
-        else return DRAW_SCORE; 
+    if (ply >= MAX_PLY - 1) return evaluateForSideToMove(state);
+    bool inCheck = isKingInCheck(state, state.whiteToMove); // Is the current player in check?
+    // A mate on the move that reaches the 50-move limit is still a mate, so that needs a legal move check
+    if (state.halfmoveClock >= 100 && (!inCheck || hasLegalMove(state))) return DRAW_SCORE;
+
+#ifdef USE_SYZYGY
+    // Tablebase cutoff: a draw is exact, a win is a lower bound and a loss an upper bound, since a faster
+    // mate may still be found in the tree. A bound that does not cut off still limits the node's score.
+    int tbFloor = -INFINITE_SCORE, tbCeiling = INFINITE_SCORE;
+    if (depth >= syzygy_probe_depth && state.halfmoveClock == 0 && !state.castlingRights &&
+        popCount(state.allPieces) <= std::min(syzygy_probe_limit, (int)TB_LARGEST)) {
+        unsigned wdl;
+        if (probeWdl(state, wdl)) {
+            td.tbHits.store(td.tbHits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            int tbScore = wdl == TB_WIN ? TB_WIN_SCORE - ply : wdl == TB_LOSS ? -TB_WIN_SCORE + ply : DRAW_SCORE + (int)wdl - (int)TB_DRAW;
+            TTEntryFlag tbFlag = wdl == TB_WIN ? TT_LOWERBOUND : wdl == TB_LOSS ? TT_UPPERBOUND : TT_EXACT;
+            if (tbFlag == TT_EXACT || (tbFlag == TT_LOWERBOUND && tbScore >= beta) || (tbFlag == TT_UPPERBOUND && tbScore <= alpha)) {
+                transpositionTable.store(currentKey, std::min(depth + 6, MAX_SEARCH_PLY), tbScore, tbFlag, 0);
+                return tbScore;
+            }
+            (tbFlag == TT_LOWERBOUND ? tbFloor : tbCeiling) = tbScore;
+        }
     }
-    if (state.positionCounts[currentKey] >= 3 || state.halfmoveClock >= 100) return DRAW_SCORE; 
-    
+#endif
+
     if (depth == 0) {
-        return quiescenceSearch(state, alpha, beta, maximizingPlayer, startTime, timeLimit, MAX_QUIESCENCE_PLY);
+        return quiescenceSearch(td, ply, alpha, beta, MAX_QUIESCENCE_PLY);
     }
 
-    const uint64_t CHECK_TIME_MASK = 1023; 
-    if ((nodes_searched.load(std::memory_order_relaxed) & CHECK_TIME_MASK) == 0) {
-        if (std::chrono::steady_clock::now() - startTime >= timeLimit) {
-            time_is_up.store(true, std::memory_order_relaxed); 
-            return 0; 
+    checkTime(td);
+    if (time_is_up.load(std::memory_order_relaxed)) return 0;
+
+    int us = state.sideToMove();
+    int staticEval = inCheck ? -INFINITE_SCORE : evaluateForSideToMove(state);
+    if (!pvNode && !inCheck) {
+        // Reverse futility pruning: so far above beta that a shallow search will not bring the score back
+        if (depth <= rfp_max_depth && staticEval - rfp_margin * depth >= beta && abs(beta) < MATE_IN_MAX_PLY) return staticEval;
+
+        // Null move pruning: if passing still fails high, some real move would too. Not with only pawns
+        // left (zugzwang is common there) and not twice in a row.
+        Bitboard nonPawnMaterial = state.occupied[us] & ~(state.pieces[us][PAWN] | state.pieces[us][KING]);
+        if (depth >= nmp_min_depth && staticEval >= beta && nonPawnMaterial && td.currentMoves[ply - 1] != Move()) {
+            int r = nmp_base_reduction + depth / nmp_depth_divisor + std::min((staticEval - beta) / nmp_eval_divisor, 3);
+            state.doNullMove();
+            td.currentMoves[ply] = Move();
+            int nullScore = -alphaBetaSearch(td, std::max(0, depth - 1 - r), ply + 1, -beta, -beta + 1);
+            state.undoNullMove();
+            if (time_is_up.load(std::memory_order_relaxed)) return 0;
+            if (nullScore >= beta) return nullScore >= MATE_IN_MAX_PLY ? beta : nullScore; // Unproven mates are not trusted
         }
     }
     
-    orderMoves(state, legalMoves); 
-    TTEntryFlag bestFlag = TT_UPPERBOUND; 
+    // Moves come from the picker, legal only: TT move, captures, killers, quiets. No move means mate or
+    // stalemate.
+    MovePicker picker(state, ttHit ? ttEntry.move : 0, &td, ply, false);
+    int originalAlpha = alpha;
+    int bestScore = -INFINITE_SCORE;
+    Move bestMove, move;
     int movesSearchedCount = 0; // Renamed to avoid conflict with std::move
-    bool inCheck = isKingInCheck(state, state.whiteToMove); // Is the current player in check?
-
-
-    if (maximizingPlayer) {
-        int maxEval = std::numeric_limits<int>::min();
-        for (const auto& move : legalMoves) { 
-            BoardState nextState = state; 
-            apply_raw_move_to_board(nextState, move); 
-            
-            int currentEval;
-            int newDepth = depth - 1;
-            bool givesCheck = isKingInCheck(nextState, nextState.whiteToMove);
-
-            // Check Extension
-            if (givesCheck && depth < MAX_SEARCH_PLY) { // Extend if giving check, but limit total depth
-                newDepth += CHECK_EXTENSION_PLY;
-            }
-
-            // Late Move Reduction (LMR)
-            bool applyLmr = false;
-            if (depth >= LMR_MIN_DEPTH_FOR_REDUCTION && 
-                movesSearchedCount >= LMR_MIN_MOVES_TO_TRY_REDUCTION && 
-                !move.isCapture(state) && 
-                move.promotionPiece == EMPTY &&
-                !inCheck && // Don't reduce if current player is in check
-                !givesCheck) { // Don't reduce if move gives check
-                applyLmr = true;
-            }
-
-            if (applyLmr) {
-                currentEval = alphaBetaSearch(nextState, newDepth - LMR_REDUCTION, alpha, beta, false, startTime, timeLimit);
-            } else {
-                currentEval = alphaBetaSearch(nextState, newDepth, alpha, beta, false, startTime, timeLimit);
-            }
-            
-            if (time_is_up.load(std::memory_order_relaxed)) return 0; 
-            
-            // Re-search if LMR was applied and the score is promising
-            if (applyLmr && currentEval > alpha) {
-                 currentEval = alphaBetaSearch(nextState, newDepth, alpha, beta, false, startTime, timeLimit);
-                 if (time_is_up.load(std::memory_order_relaxed)) return 0; 
-            }
-
-            if (currentEval > maxEval) maxEval = currentEval; 
-            
-            if (currentEval > alpha) {
-                alpha = currentEval;
-                bestFlag = TT_EXACT; 
-            }
-            if (beta <= alpha) { 
-                 bestFlag = TT_LOWERBOUND; 
-                 break; 
-            }
-            movesSearchedCount++;
-        }
-        if (!time_is_up.load(std::memory_order_relaxed) && (transpositionTable.size() < MAX_TT_SIZE || tt_it != transpositionTable.end())) { 
-            TTEntry newEntry; newEntry.score = maxEval; newEntry.depth = depth; newEntry.flag = bestFlag;
-            transpositionTable[currentKey] = newEntry;
-        }
-        return maxEval; 
-    } else { // Minimizing Player
-        int minEval = std::numeric_limits<int>::max();
-        for (const auto& move : legalMoves) { 
-            BoardState nextState = state; apply_raw_move_to_board(nextState, move); 
-            int currentEval;
-            int newDepth = depth - 1;
-            bool givesCheck = isKingInCheck(nextState, nextState.whiteToMove);
-
-            // Check Extension
-            if (givesCheck && depth < MAX_SEARCH_PLY) {
-                newDepth += CHECK_EXTENSION_PLY;
-            }
-
-            // Late Move Reduction (LMR)
-            bool applyLmr = false;
-            if (depth >= LMR_MIN_DEPTH_FOR_REDUCTION && 
-                movesSearchedCount >= LMR_MIN_MOVES_TO_TRY_REDUCTION && 
-                !move.isCapture(state) && 
-                move.promotionPiece == EMPTY &&
-                !inCheck && 
-                !givesCheck) {
-                applyLmr = true;
-            }
-
-            if (applyLmr) {
-                 currentEval = alphaBetaSearch(nextState, newDepth - LMR_REDUCTION, alpha, beta, true, startTime, timeLimit);
-            } else {
-                 currentEval = alphaBetaSearch(nextState, newDepth, alpha, beta, true, startTime, timeLimit);
-            }
-
-            if (time_is_up.load(std::memory_order_relaxed)) return 0;
+    int legalMoveCount = 0;
+    Move quietsTried[64]; // Quiet moves searched without a cutoff, they lose history if a later one cuts off
+    int quietCount = 0;
+
+    while (picker.next(move)) { 
+        bool isCapture = move.isCapture(state);
+        bool isQuiet = !isCapture && !move.isPromotion();
+        int moveHistory = isQuiet ? td.history[us][move.fromSquare()][move.toSquare()] : 0;
+        state.doMove(move); 
+        legalMoveCount++;
+        td.currentMoves[ply] = move;
+        
+        int newDepth = depth - 1;
+        bool givesCheck = isKingInCheck(state, state.whiteToMove);
+
+        // Late move and futility pruning of quiet moves, once some move has been searched and scored above a
+        // mate. Such moves still count as legal, so the node is not mistaken for mate or stalemate.
+        if (!pvNode && !inCheck && !givesCheck && isQuiet && !picker.isRefutation(move) && bestScore > -MATE_IN_MAX_PLY) {
+            bool lateMove = depth <= lmp_max_depth && movesSearchedCount >= lmp_base + depth * depth;
+            bool futile = depth <= fp_max_depth && staticEval + fp_base + fp_margin * depth <= alpha;
+            if (lateMove || futile) { state.undoMove(move); continue; }
+        }
 
-            // Re-search for LMR
-            if (applyLmr && currentEval < beta) {
-                 currentEval = alphaBetaSearch(nextState, newDepth, alpha, beta, true, startTime, timeLimit);
-                 if (time_is_up.load(std::memory_order_relaxed)) return 0;
-            }
+        // Check Extension
+        if (givesCheck && depth < MAX_SEARCH_PLY) { // Extend if giving check, but limit total depth
+            newDepth += CHECK_EXTENSION_PLY;
+            STAT_INC(td, checkExtensions);
+        }
 
-            if (currentEval < minEval) minEval = currentEval; 
-            
-            if (currentEval < beta) {
-                beta = currentEval;
-                bestFlag = TT_EXACT; 
+        // Late Move Reduction (LMR)
+        bool applyLmr = false;
+        if (depth >= LMR_MIN_DEPTH_FOR_REDUCTION && 
+            movesSearchedCount >= LMR_MIN_MOVES_TO_TRY_REDUCTION && 
+            isQuiet &&
+            !picker.isRefutation(move) && // Killers and the counter move are searched in full
+            !inCheck && // Don't reduce if current player is in check
+            !givesCheck) { // Don't reduce if move gives check
+            applyLmr = true;
+        }
+        int reduction = lmr_reductions[std::min(depth, LMR_TABLE_SIZE - 1)][std::min(legalMoveCount, LMR_TABLE_SIZE - 1)];
+        reduction += (moveHistory < 0 ? 1 : 0); // One more ply for moves that keep failing
+        reduction = std::min(reduction, newDepth - 1); // Reduced moves still get a full ply of search
+        if (reduction <= 0) applyLmr = false;
+
+        int score;
+        if (legalMoveCount == 1) {
+            score = -alphaBetaSearch(td, newDepth, ply + 1, -beta, -alpha);
+        } else {
+            score = -alphaBetaSearch(td, applyLmr ? newDepth - reduction : newDepth, ply + 1, -alpha - 1, -alpha);
+            if (applyLmr) STAT_INC(td, lmrSearches);
+            // A reduced move that beats alpha is verified at full depth, then with the full window if it still does
+            if (applyLmr && score > alpha && !time_is_up.load(std::memory_order_relaxed)) {
+                STAT_INC(td, lmrResearches);
+                score = -alphaBetaSearch(td, newDepth, ply + 1, -alpha - 1, -alpha);
             }
-            if (beta <= alpha) { 
-                bestFlag = TT_UPPERBOUND; 
-                break; 
+            if (score > alpha && score < beta && !time_is_up.load(std::memory_order_relaxed))
+                score = -alphaBetaSearch(td, newDepth, ply + 1, -beta, -alpha);
+        }
+        state.undoMove(move);
+        if (time_is_up.load(std::memory_order_relaxed)) return 0; 
+
+        if (score > bestScore) {
+            bestScore = score;
+            bestMove = move;
+            if (score > alpha) {
+                alpha = score;
+                td.pvTable[ply][0] = move;
+                std::copy(td.pvTable[ply + 1], td.pvTable[ply + 1] + td.pvLength[ply + 1], td.pvTable[ply] + 1);
+                td.pvLength[ply] = td.pvLength[ply + 1] + 1;
             }
-            movesSearchedCount++;
         }
-        if (!time_is_up.load(std::memory_order_relaxed) && (transpositionTable.size() < MAX_TT_SIZE || tt_it != transpositionTable.end())) {
-            TTEntry newEntry; newEntry.score = minEval; newEntry.depth = depth; newEntry.flag = bestFlag;
-            transpositionTable[currentKey] = newEntry;
+        if (alpha >= beta) { 
+            STAT_INC(td, betaCutoffs);
+            if (movesSearchedCount == 0) STAT_INC(td, firstMoveCutoffs);
+            if (isQuiet) updateQuietStats(td, ply, move, depth, quietsTried, quietCount);
+            break; 
         }
-        return minEval; 
+        if (isQuiet && quietCount < 64) quietsTried[quietCount++] = move;
+        movesSearchedCount++;
     }
+    if (legalMoveCount == 0) return inCheck ? -MATE_SCORE + ply : DRAW_SCORE;
+#ifdef USE_SYZYGY
+    bestScore = std::max(tbFloor, std::min(bestScore, tbCeiling));
+#endif
+
+    TTEntryFlag bestFlag = bestScore >= beta ? TT_LOWERBOUND : bestScore > originalAlpha ? TT_EXACT : TT_UPPERBOUND;
+    transpositionTable.store(currentKey, depth, scoreToTT(bestScore, ply), bestFlag, bestMove.data);
+    return bestScore; 
 }
 
 // --- Game Logic --- 
 void master_apply_move(const Move& move) {
-    char piece = currentBoard.board[move.fromRow][move.fromCol];
-    char captured = currentBoard.board[move.toRow][move.toCol]; 
-    bool isPawn = (toupper(piece) == W_PAWN);
-    bool isCap = (captured != EMPTY) || move.isEnPassantCapture;
-    apply_raw_move_to_board(currentBoard, move); 
-    if (isPawn || isCap) { currentBoard.halfmoveClock = 0; } else { currentBoard.halfmoveClock++; }
-    if (!currentBoard.whiteToMove) { currentBoard.fullmoveNumber++; }
-    currentBoard.addCurrentPositionToHistory(); 
-}
-bool isCheckmate() { std::vector<Move> m; generateLegalMoves(currentBoard, m, false); return m.empty() && isKingInCheck(currentBoard, currentBoard.whiteToMove); }
-bool isStalemate() { std::vector<Move> m; generateLegalMoves(currentBoard, m, false); return m.empty() && !isKingInCheck(currentBoard, currentBoard.whiteToMove); }
-bool isThreefoldRepetition() { return currentBoard.positionCounts[currentBoard.currentFenKey] >= 3; }
+    currentBoard.doMove(move); 
+    if (currentBoard.whiteToMove) { currentBoard.fullmoveNumber++; }
+}
+bool isCheckmate() { MoveList m; generateLegalMoves(currentBoard, m, false); return m.empty() && isKingInCheck(currentBoard, currentBoard.whiteToMove); }
+bool isStalemate() { MoveList m; generateLegalMoves(currentBoard, m, false); return m.empty() && !isKingInCheck(currentBoard, currentBoard.whiteToMove); }
+bool isThreefoldRepetition() { return currentBoard.isRepetition(0); }
 bool isFiftyMoveDraw() { return currentBoard.halfmoveClock >= 100; }
 std::string checkGameEndStatus() {
     if (isCheckmate()) return currentBoard.whiteToMove ? "0-1 {Black mates}" : "1-0 {White mates}";
@@ -729,50 +1958,615 @@ std::string checkGameEndStatus() {
     return ""; 
 }
 
+// --- Opening Book (Polyglot) ---
+// A Polyglot .bin book is an array of 16-byte big-endian entries (uint64 key, uint16 move, uint16 weight,
+// uint32 learn) sorted by key. The BookFile option maps it; "go" binary searches for the position's key
+// and plays one of its moves at once, picked with probability proportional to its weight.
+//
+// The key XORs one 64-bit number per (piece kind, square), castling right, en passant file (only when a
+// pawn of the side to move can take en passant) and White to move, at indices 64 * kind + 8 * rank + file
+// (kind: black pawn 0, white pawn 1, ..., white king 11; rank 0 is White's back rank), 768 + right
+// (K, Q, k, q), 772 + file and 780. Books written by the Polyglot tools use the Random64 table from the
+// Polyglot sources: the BookKeys option loads it from a text file, and it is only taken if it reproduces
+// the keys published with the format. Without it the numbers come from a fixed seed, which reads books
+// written by "makebook" but no others.
+const int POLYGLOT_RANDOM_COUNT = 781;
+const size_t POLYGLOT_ENTRY_SIZE = 16;
+uint64_t POLYGLOT_RANDOM[POLYGLOT_RANDOM_COUNT];
+MappedFile book_file;
+
+void initPolyglot() {
+    std::mt19937_64 rng(0x5DEECE66DULL);
+    for (uint64_t& key : POLYGLOT_RANDOM) key = rng();
+}
+
+// The test positions and keys from the Polyglot book format description
+const std::pair<const char*, uint64_t> POLYGLOT_TEST_KEYS[] = {
+    {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 0x463b96181691fc9cULL},
+    {"rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq e3 0 1", 0x823c9b50fd114196ULL},
+    {"rnbqkbnr/ppp1pppp/8/3p4/4P3/8/PPPP1PPP/RNBQKBNR w KQkq d6 0 2", 0x0756b94461c50fb0ULL},
+    {"rnbqkbnr/ppp1pppp/8/3pP3/8/8/PPPP1PPP/RNBQKBNR b KQkq - 0 2", 0x662fafb965db29d4ULL},
+    {"rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPP1PPP/RNBQKBNR w KQkq f6 0 3", 0x22a48b5a8e47ff78ULL},
+    {"rnbqkbnr/ppp1p1pp/8/3pPp2/8/8/PPPPKPPP/RNBQ1BNR b kq - 0 3", 0x652a607ca3f242c1ULL},
+    {"rnbq1bnr/ppp1pkpp/8/3pPp2/8/8/PPPPKPPP/RNBQ1BNR w - - 0 4", 0x00fdd303c946bdd9ULL},
+    {"rnbqkbnr/p1pppppp/8/8/PpP4P/8/1P1PPPP1/RNBQKBNR b KQkq c3 0 3", 0x3c8123ea7b067637ULL},
+    {"rnbqkbnr/p1pppppp/8/8/P6P/R1p5/1P1PPPP1/1NBQKBNR b Kkq - 0 4", 0x5c3f9b829b279560ULL},
+};
+
+uint64_t polyglotKey(const BoardState& state) {
+    uint64_t key = 0;
+    for (int sq = 0; sq < 64; ++sq) {
+        char piece = state.pieceOn(sq);
+        if (piece == EMPTY) continue;
+        int pieceType = pieceIndex(piece) % 6;
+        int kind = 2 * pieceType + (isupper(piece) ? 1 : 0);
+        key ^= POLYGLOT_RANDOM[64 * kind + 8 * (7 - (sq >> 3)) + (sq & 7)];
+    }
+    const int rights[4] = {CASTLE_WK, CASTLE_WQ, CASTLE_BK, CASTLE_BQ};
+    for (int i = 0; i < 4; ++i) if (state.castlingRights & rights[i]) key ^= POLYGLOT_RANDOM[768 + i];
+    if (state.enPassantSquare != -1) {
+        int them = state.whiteToMove ? BLACK : WHITE; // A pawn of ours takes on the square it would attack from there
+        if (pawn_attacks[them][state.enPassantSquare] & state.pieces[state.sideToMove()][PAWN])
+            key ^= POLYGLOT_RANDOM[772 + (state.enPassantSquare & 7)];
+    }
+    if (state.whiteToMove) key ^= POLYGLOT_RANDOM[780];
+    return key;
+}
+
+// Reads the 781 Random64 numbers from a text file, as they are printed in the Polyglot sources ("0x" hex
+// numbers; any other text between them is skipped). The table is kept only if it reproduces every
+// POLYGLOT_TEST_KEYS key, otherwise the current one stays.
+bool loadBookKeys(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) return false;
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    std::string text = contents.str();
+    std::vector<uint64_t> numbers;
+    for (size_t pos = text.find("0x"); pos != std::string::npos; pos = text.find("0x", pos + 2)) {
+        numbers.push_back(std::strtoull(text.c_str() + pos + 2, nullptr, 16));
+    }
+    if (numbers.size() != POLYGLOT_RANDOM_COUNT) return false;
+    uint64_t saved[POLYGLOT_RANDOM_COUNT];
+    std::copy(std::begin(POLYGLOT_RANDOM), std::end(POLYGLOT_RANDOM), saved);
+    std::copy(numbers.begin(), numbers.end(), POLYGLOT_RANDOM);
+    for (const auto& test : POLYGLOT_TEST_KEYS) {
+        BoardState board;
+        board.parseFen(test.first);
+        if (polyglotKey(board) != test.second) {
+            std::copy(std::begin(saved), std::end(saved), POLYGLOT_RANDOM);
+            return false;
+        }
+    }
+    return true;
+}
+
+uint64_t readBigEndian(const unsigned char* bytes, int count) {
+    uint64_t value = 0;
+    for (int i = 0; i < count; ++i) value = (value << 8) | bytes[i];
+    return value;
+}
+
+// Turns a book move into the matching legal move: Polyglot squares count from a1, promotions are 1 (knight)
+// to 4 (queen) in bits 12-14, and castling is written as the king taking its own rook.
+Move polyglotToMove(BoardState& state, uint16_t bookMove) {
+    int to = (7 - ((bookMove >> 3) & 7)) * 8 + (bookMove & 7);
+    int from = (7 - ((bookMove >> 9) & 7)) * 8 + ((bookMove >> 6) & 7);
+    int promotion = (bookMove >> 12) & 7;
+    char piece = state.pieceOn(from);
+    if (toupper(piece) == W_KING && (to == from + 3 || to == from - 4)) to = (to > from) ? from + 2 : from - 2;
+    MoveList legal;
+    generateLegalMoves(state, legal, false);
+    for (const Move& move : legal) {
+        if (move.fromSquare() != from || move.toSquare() != to) continue;
+        if (move.isPromotion() ? move.flag() == promotion : promotion == 0) return move;
+    }
+    return Move();
+}
+
+// The inverse of polyglotToMove
+uint16_t moveToPolyglot(const Move& move) {
+    int from = move.fromSquare(), to = move.toSquare();
+    if (move.flag() == FLAG_CASTLE) to = (to > from) ? from + 3 : from - 4;
+    int promotion = move.isPromotion() ? move.flag() : 0;
+    return (uint16_t)((to & 7) | (7 - (to >> 3)) << 3 | (from & 7) << 6 | (7 - (from >> 3)) << 9 | promotion << 12);
+}
+
+// Returns a book move for the position, or the null move if the book is not loaded or has none.
+Move probeBook(BoardState& state) {
+    if (!book_file.data) return Move();
+    uint64_t key = polyglotKey(state);
+    size_t count = book_file.size / POLYGLOT_ENTRY_SIZE;
+    size_t lo = 0, hi = count; // First entry with a key not below the position's
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (readBigEndian(book_file.data + mid * POLYGLOT_ENTRY_SIZE, 8) < key) lo = mid + 1; else hi = mid;
+    }
+    Move chosen;
+    uint64_t totalWeight = 0;
+    for (size_t i = lo; i < count; ++i) {
+        const unsigned char* entry = book_file.data + i * POLYGLOT_ENTRY_SIZE;
+        if (readBigEndian(entry, 8) != key) break;
+        uint64_t weight = readBigEndian(entry + 10, 2);
+        Move move = polyglotToMove(state, (uint16_t)readBigEndian(entry + 8, 2));
+        if (weight == 0 || move == Move()) continue;
+        totalWeight += weight; // Weighted reservoir pick: keep this move with probability weight / total so far
+        if (std::uniform_int_distribution<uint64_t>(1, totalWeight)(global_rng) <= weight) chosen = move;
+    }
+    return chosen;
+}
+
+// Maps the book named by BookFile; the file must hold whole entries.
+bool loadBook(const std::string& path) {
+    if (!book_file.open(path)) return false;
+    if (book_file.size % POLYGLOT_ENTRY_SIZE != 0) { book_file.close(); return false; }
+    return true;
+}
+
+void writeBigEndian(std::ostream& out, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; --i) out.put((char)((value >> (8 * i)) & 0xFF));
+}
+
+// Writes a book keyed with the current table from a text file of "<FEN> ; <move> [weight]" lines
+// (weight 1 if left out; empty lines and '#' comments are skipped), so books for the fixed-seed keys can
+// be made without the Polyglot tools. Returns the number of entries, or -1 if a file cannot be opened or
+// a line does not name a legal move.
+long long makeBook(const std::string& inputPath, const std::string& outputPath) {
+    std::ifstream in(inputPath);
+    if (!in) return -1;
+    std::vector<std::pair<uint64_t, uint32_t>> entries; // Key, and move << 16 | weight
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t separator = line.find(';');
+        if (line.empty() || line[0] == '#' || separator == std::string::npos) continue;
+        std::string fen = line.substr(0, separator), moveText;
+        fen.erase(fen.find_last_not_of(" \t") + 1);
+        uint32_t weight = 1;
+        std::istringstream(line.substr(separator + 1)) >> moveText >> weight;
+        BoardState board;
+        if (fen.empty() || !board.parseFen(fen)) return -1;
+        MoveList legal;
+        generateLegalMoves(board, legal, false);
+        Move move;
+        for (const Move& candidate : legal) if (candidate.toUci() == moveText) move = candidate;
+        if (move == Move()) return -1;
+        entries.push_back({polyglotKey(board), (uint32_t)moveToPolyglot(move) << 16 | std::min(weight, 0xFFFFu)});
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::ofstream out(outputPath, std::ios::binary);
+    for (const auto& entry : entries) {
+        writeBigEndian(out, entry.first, 8);
+        writeBigEndian(out, entry.second, 4); // Move, weight
+        writeBigEndian(out, 0, 4);            // Learn
+    }
+    return out ? (long long)entries.size() : -1;
+}
+
 // --- UCI Handling --- 
-void handleUci() { std::cout << "id name Geminina\nid author LLM Developer\nuciok" << std::endl; } 
-void handleIsReady() { std::cout << "readyok" << std::endl; }
+// The last "position" command: its start ("startpos" or "fen ...") and move tokens, and the key of
+// currentBoard right after it, so that a later change to currentBoard by anything else is noticed
+std::string position_base;
+std::vector<std::string> position_moves;
+uint64_t position_key = 0;
+
+void handleUci() { 
+    std::cout << "id name Geminina\nid author LLM Developer\n"
+              << "option name Hash type spin default " << TT_DEFAULT_MB << " min 1 max " << TT_MAX_MB << "\n"
+              << "option name Clear Hash type button\n"
+              << "option name Threads type spin default 1 min 1 max " << MAX_THREADS << "\n"
+              << "option name EvalFile type string default <empty>\n"
+              << "option name BookFile type string default <empty>\n"
+              << "option name BookKeys type string default <empty>\n";
+#ifdef USE_SYZYGY
+    std::cout << "option name SyzygyPath type string default <empty>\n"
+              << "option name SyzygyProbeLimit type spin default " << syzygy_probe_limit << " min 0 max 7\n"
+              << "option name SyzygyProbeDepth type spin default " << syzygy_probe_depth << " min 1 max " << MAX_SEARCH_PLY << "\n";
+#endif
+    for (const SearchParam& param : SEARCH_PARAMS)
+        std::cout << "option name " << param.name << " type spin default " << *param.value << " min " << param.min << " max " << param.max << "\n";
+    std::cout << "uciok" << std::endl; 
+} 
+void handleIsReady() { std::lock_guard<std::mutex> lock(io_mutex); std::cout << "readyok" << std::endl; }
 void handleUciNewGame() { 
     currentBoard.reset(); 
+    position_base.clear(); // The next "position" starts over rather than extending the last game's line
+    position_moves.clear();
+    position_key = 0;
     transpositionTable.clear(); 
+    clearSearchHistory();
 }
+// setoption name <id> [value <x>]. Option names are matched case-insensitively, as UCI requires.
+void handleSetOption(std::istringstream& iss) {
+    std::string token, name, value;
+    iss >> token; // "name"
+    while (iss >> token && token != "value") name += (name.empty() ? "" : " ") + token;
+    while (iss >> token) value += (value.empty() ? "" : " ") + token;
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (name == "hash") {
+        long long mb = 0;
+        std::istringstream(value) >> mb;
+        if (mb > 0) transpositionTable.resize((size_t)mb);
+    } else if (name == "clear hash") {
+        transpositionTable.clear();
+    } else if (name == "threads") {
+        int threads = 0;
+        std::istringstream(value) >> threads;
+        if (threads > 0) setThreadCount(threads);
+    } else if (name == "evalfile") {
+        if (value.empty() || value == "<empty>") {
+            nnue_net.reset();
+            std::cout << "info string using PST evaluation" << std::endl;
+        } else if (loadNnue(value)) {
+            std::cout << "info string loaded network " << value << std::endl;
+        } else {
+            std::cout << "info string failed to load network " << value << ", keeping the current evaluation" << std::endl;
+        }
+        currentBoard.resetAccumulators();
+    } else if (name == "bookfile") {
+        if (value.empty() || value == "<empty>") {
+            book_file.close();
+        } else if (loadBook(value)) {
+            std::cout << "info string loaded book " << value << " (" << book_file.size / POLYGLOT_ENTRY_SIZE << " entries)" << std::endl;
+        } else {
+            std::cout << "info string failed to load book " << value << std::endl;
+        }
+    } else if (name == "bookkeys") {
+        if (value.empty() || value == "<empty>") {
+            initPolyglot();
+        } else if (loadBookKeys(value)) {
+            std::cout << "info string loaded book keys " << value << std::endl;
+        } else {
+            std::cout << "info string failed to load book keys " << value << ", keeping the current keys" << std::endl;
+        }
+#ifdef USE_SYZYGY
+    } else if (name == "syzygypath") {
+        if (value.empty() || value == "<empty>") {
+            tb_free();
+        } else if (tb_init(value.c_str()) && TB_LARGEST > 0) {
+            std::cout << "info string found " << TB_LARGEST << "-piece tablebases in " << value << std::endl;
+        } else {
+            std::cout << "info string no tablebases found in " << value << std::endl;
+        }
+    } else if (name == "syzygyprobelimit") {
+        std::istringstream(value) >> syzygy_probe_limit;
+        syzygy_probe_limit = std::max(0, std::min(syzygy_probe_limit, 7));
+    } else if (name == "syzygyprobedepth") {
+        std::istringstream(value) >> syzygy_probe_depth;
+        syzygy_probe_depth = std::max(1, std::min(syzygy_probe_depth, MAX_SEARCH_PLY));
+#endif
+    } else {
+        for (const SearchParam& param : SEARCH_PARAMS) {
+            std::string paramName = param.name;
+            std::transform(paramName.begin(), paramName.end(), paramName.begin(), ::tolower);
+            if (name != paramName) continue;
+            int v = *param.value;
+            std::istringstream(value) >> v;
+            *param.value = std::max(param.min, std::min(v, param.max));
+            initReductions();
+        }
+    }
+}
+// Builds the move a UCI string names in this position, its castling, en passant or promotion flag taken
+// from the pieces involved, or the null move if the string is malformed. It still has to pass
+// isPseudoLegal and isLegal.
+Move moveFromUci(const BoardState& state, const std::string& uci) {
+    if (uci.size() < 4 || uci[0] < 'a' || uci[0] > 'h' || uci[1] < '1' || uci[1] > '8' ||
+        uci[2] < 'a' || uci[2] > 'h' || uci[3] < '1' || uci[3] > '8') return Move();
+    int from = ('8' - uci[1]) * 8 + (uci[0] - 'a'), to = ('8' - uci[3]) * 8 + (uci[2] - 'a');
+    char piece = toupper(state.pieceOn(from));
+    int flag = FLAG_NONE;
+    if (uci.size() > 4) {
+        size_t promotion = std::string("nbrq").find((char)tolower(uci[4]));
+        if (promotion == std::string::npos) return Move();
+        flag = FLAG_PROMO_KNIGHT + (int)promotion;
+    } else if (piece == W_KING && abs(to - from) == 2) {
+        flag = FLAG_CASTLE;
+    } else if (piece == W_PAWN && to == state.enPassantSquare && (from & 7) != (to & 7)) {
+        flag = FLAG_EN_PASSANT;
+    }
+    return Move(from, to, flag);
+}
+
+// GUIs resend the whole game before every "go". When the start is the same and the move list extends the
+// last one, only the new moves are applied. Each move is checked with isPseudoLegal and isLegal rather
+// than by generating all legal moves; moves after an illegal one are ignored.
+// The transposition table is kept across positions: entries are verified by full key and aged out.
 void handlePosition(std::istringstream& iss) {
-    std::string token, fen_str; iss >> token; 
+    std::string token, base;
+    iss >> token; 
     if (token == "startpos") { 
-        currentBoard.reset(); 
-        transpositionTable.clear(); 
+        base = token;
         iss >> token; 
     } else if (token == "fen") {
+        std::string fen_str;
         while(iss >> token && token != "moves") { fen_str += token + " "; }
         if (!fen_str.empty()) fen_str.pop_back(); 
-        currentBoard.parseFen(fen_str);
-        transpositionTable.clear(); 
+        base = "fen " + fen_str;
     } 
-    if (token == "moves") { 
-        while (iss >> token) { 
-            Move pMove; if (token.length() < 4) continue; 
-            pMove.fromCol = token[0] - 'a'; pMove.fromRow = '8' - token[1];
-            pMove.toCol = token[2] - 'a'; pMove.toRow = '8' - token[3];
-            pMove.promotionPiece = EMPTY;
-            if (token.length() == 5) { 
-                char promo = token[4]; char pieceColor = currentBoard.whiteToMove ? 'W' : 'B';
-                if (promo == 'q') pMove.promotionPiece = (pieceColor == 'W' ? W_QUEEN : B_QUEEN);
-                else if (promo == 'r') pMove.promotionPiece = (pieceColor == 'W' ? W_ROOK : B_ROOK);
-                else if (promo == 'b') pMove.promotionPiece = (pieceColor == 'W' ? W_BISHOP : B_BISHOP);
-                else if (promo == 'n') pMove.promotionPiece = (pieceColor == 'W' ? W_KNIGHT : B_KNIGHT);
+    std::vector<std::string> moves;
+    if (token == "moves") { while (iss >> token) moves.push_back(token); }
+
+    bool extendsLast = !base.empty() && base == position_base && currentBoard.hashKey == position_key &&
+                       moves.size() >= position_moves.size() && std::equal(position_moves.begin(), position_moves.end(), moves.begin());
+    if (!extendsLast) {
+        if (base == "startpos") currentBoard.reset();
+        else if (!base.empty() && !currentBoard.parseFen(base.substr(4))) {
+            std::cout << "info string invalid position " << base.substr(4) << ", keeping the current one" << std::endl;
+            base.clear();
+            moves.clear();
+        }
+        position_moves.clear();
+    }
+    position_base = base;
+    for (size_t i = position_moves.size(); i < moves.size(); ++i) {
+        if (moves[i].length() >= 4) {
+            Move move = moveFromUci(currentBoard, moves[i]);
+            if (!isPseudoLegal(currentBoard, move) || !isLegal(currentBoard, move, computeLegality(currentBoard))) break;
+            master_apply_move(move);
+        }
+        position_moves.push_back(moves[i]);
+    }
+    position_key = currentBoard.hashKey;
+}
+
+// "cp <centipawns>" or "mate <moves>". Mate scores count plies from the root: mate in (plies + 1) / 2
+// moves, negative if we are mated.
+std::string uciScore(int score) {
+    if (score >= MATE_IN_MAX_PLY) return "mate " + std::to_string((MATE_SCORE - score + 1) / 2);
+    if (score <= -MATE_IN_MAX_PLY) return "mate " + std::to_string(-(MATE_SCORE + score) / 2);
+    return "cp " + std::to_string(score);
+}
+
+// --- Iterative Deepening (run by every search thread) ---
+// Helper threads skip some depths so that they spread over different iterations (Lazy SMP).
+const int SMP_SKIP_SIZE[]  = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+const int SMP_SKIP_PHASE[] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
+// Searches every root move to the given depth inside [alpha, beta], the first with the full window and the
+// rest as in alphaBetaSearch, and returns the best score (a bound if it falls outside the window). A move
+// that beats alpha moves to the front of rootMoves and its line goes to td.pvTable[0]. With the random
+// tie-break on, later moves are searched against a bound one below the best score, so moves that equal
+// it get an exact score and one of them is picked at random. If the search is aborted after a later move
+// has beaten the first one, that move is adopted as the thread's best move even though the iteration is
+// incomplete: it was searched to the full depth and proved better than the previous best.
+int searchRoot(SearchThread& td, MoveList& rootMoves, int depth, int alpha, int beta) {
+    BoardState& board = td.board;
+    int tieOffset = search_limits.randomTieBreak ? 1 : 0;
+    int bestScore = -INFINITE_SCORE, bestIndex = -1, ties = 0;
+    td.pvLength[0] = 0;
+    for (int i = 0; i < rootMoves.size(); ++i) {
+        Move move = rootMoves[i];
+        board.doMove(move);
+        td.currentMoves[0] = move;
+        int score;
+        if (i == 0) {
+            score = -alphaBetaSearch(td, depth - 1, 1, -beta, -alpha);
+        } else {
+            int bound = std::max(alpha, bestScore - tieOffset);
+            score = -alphaBetaSearch(td, depth - 1, 1, -bound - 1, -bound);
+            if (score > bound && score < beta && !time_is_up.load(std::memory_order_relaxed))
+                score = -alphaBetaSearch(td, depth - 1, 1, -beta, -bound);
+        }
+        board.undoMove(move);
+        if (time_is_up.load(std::memory_order_relaxed)) {
+            if (bestIndex > 0) {
+                td.bestMove = rootMoves[bestIndex];
+                std::copy(td.pvTable[0], td.pvTable[0] + td.pvLength[0], td.rootPv);
+                td.rootPvLength = td.pvLength[0];
             }
-            std::vector<Move> legal_moves; generateLegalMoves(currentBoard, legal_moves, false);
-            Move moveToApply; bool found = false;
-            for (const auto& legal_m : legal_moves) {
-                if (legal_m.fromRow == pMove.fromRow && legal_m.fromCol == pMove.fromCol &&
-                    legal_m.toRow == pMove.toRow && legal_m.toCol == pMove.toCol &&
-                    legal_m.promotionPiece == pMove.promotionPiece ) {
-                    moveToApply = legal_m; found = true; break;
-                }
+            return bestScore; // The caller drops the iteration
+        }
+
+        bool isTie = tieOffset && score == bestScore && score > alpha && score < beta; // Only exact scores can tie
+        if (isTie) ties++;
+        if (score > bestScore || (isTie && std::uniform_int_distribution<int>(0, ties)(td.rng) == 0)) {
+            if (score > bestScore) ties = 0;
+            bestScore = score;
+            if (score > alpha) {
+                bestIndex = i;
+                td.pvTable[0][0] = move;
+                std::copy(td.pvTable[1], td.pvTable[1] + td.pvLength[1], td.pvTable[0] + 1);
+                td.pvLength[0] = td.pvLength[1] + 1;
+            }
+        }
+        if (bestScore >= beta) break;
+    }
+    if (bestIndex > 0) std::rotate(rootMoves.moves, rootMoves.moves + bestIndex, rootMoves.moves + bestIndex + 1);
+    return bestScore;
+}
+
+// Soft time limit factor by bestMoveStability: a new best move doubles the budget, a stable one shrinks it
+const double STABILITY_SCALE[5] = {2.0, 1.4, 1.1, 0.9, 0.7};
+
+// Each iteration searches a window of ASPIRATION_WINDOW around the last score; on a fail low or high it
+// is widened on that side (growing by half each time) and the depth searched again.
+void iterativeDeepening(SearchThread& td) {
+    BoardState& searchBoard = td.board;
+    bool isMainThread = (td.id == 0);
+    MoveList legalEngineMoves;
+    generateLegalMoves(searchBoard, legalEngineMoves, false);
+    if (!search_limits.searchMoves.empty()) { // "go searchmoves": keep the listed moves, unless none is legal
+        MoveList allowed;
+        for (const Move& move : legalEngineMoves) {
+            const std::vector<Move>& only = search_limits.searchMoves;
+            if (std::find(only.begin(), only.end(), move) != only.end()) allowed.add(move);
+        }
+        if (!allowed.empty()) legalEngineMoves = allowed;
+    }
+    if (legalEngineMoves.empty()) return;
+
+    orderMoves(searchBoard, legalEngineMoves); 
+    td.bestMove = legalEngineMoves[0];
+    td.rootPvLength = 0;
+    int bestMoveStability = 0; // Completed iterations in a row that kept the best move, up to 4
+#ifdef SEARCH_STATS
+    uint64_t previousIterationNodes = 0; // For the effective branching factor
+#endif
+
+    // Iterative Deepening Loop
+    for (int currentDepth = 1; currentDepth <= search_limits.depth; ++currentDepth) {
+        if (!isMainThread) {
+            int skip = (td.id - 1) % 20;
+            if (((currentDepth + SMP_SKIP_PHASE[skip]) / SMP_SKIP_SIZE[skip]) % 2) continue;
+        }
+        int delta = ASPIRATION_WINDOW;
+        int alpha = -INFINITE_SCORE, beta = INFINITE_SCORE;
+        if (currentDepth >= ASPIRATION_MIN_DEPTH && abs(td.bestScore) < MATE_IN_MAX_PLY) {
+            alpha = std::max(td.bestScore - delta, -INFINITE_SCORE);
+            beta = std::min(td.bestScore + delta, INFINITE_SCORE);
+        }
+        int score;
+        while (true) {
+            score = searchRoot(td, legalEngineMoves, currentDepth, alpha, beta);
+            if (time_is_up.load(std::memory_order_relaxed)) break;
+            if (score <= alpha) {
+                beta = (alpha + beta) / 2;
+                alpha = std::max(score - delta, -INFINITE_SCORE);
+            } else if (score >= beta) {
+                beta = std::min(score + delta, INFINITE_SCORE);
+            } else {
+                break;
             }
-            if (found) { master_apply_move(moveToApply); } else { break; }
+            delta += delta / 2;
+        }
+        if (time_is_up.load(std::memory_order_relaxed)) { break; }
+
+        bestMoveStability = (legalEngineMoves[0] == td.bestMove) ? std::min(bestMoveStability + 1, 4) : 0;
+        int scoreDrop = (td.completedDepth > 0) ? td.bestScore - score : 0;
+        td.bestMove = legalEngineMoves[0];
+        td.bestScore = score; 
+        td.completedDepth = currentDepth;
+        std::copy(td.pvTable[0], td.pvTable[0] + td.pvLength[0], td.rootPv);
+        td.rootPvLength = td.pvLength[0];
+        if (!isMainThread) continue; // Helpers only feed the shared table; the main thread reports and decides when to stop
+
+        if (search_limits.printInfo) {
+            long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - search_start_time).count();
+            uint64_t nodes = totalNodesSearched();
+            uint64_t nps = (elapsed_ms > 0) ? (nodes * 1000 / elapsed_ms) : 0;
+
+            std::string pv;
+            for (int i = 0; i < td.rootPvLength; ++i) pv += (i ? " " : "") + td.rootPv[i].toUci();
+            std::lock_guard<std::mutex> lock(io_mutex);
+            std::cout << "info depth " << currentDepth 
+                      << " score " << uciScore(td.bestScore)
+                      << " time " << elapsed_ms 
+                      << " nodes " << nodes
+                      << " nps " << nps
+                      << " hashfull " << transpositionTable.hashfull()
+                      << " tbhits " << totalTbHits()
+                      << " pv " << pv << std::endl; 
+#ifdef SEARCH_STATS
+            uint64_t iterationNodes = td.stats.mainNodes + td.stats.qsNodes;
+            std::cout << "info string stats depth " << currentDepth << " " << td.stats.format() << " ebf " << std::fixed << std::setprecision(2)
+                      << (previousIterationNodes ? (double)iterationNodes / previousIterationNodes : 0.0) << std::defaultfloat << std::endl;
+            previousIterationNodes = iterationNodes;
+#endif
+        }
+
+        // Soft limit: spend more time while the best move keeps changing or the score falls, less once
+        // it has been stable for a few iterations
+        if (search_limits.softTimeMs >= 0 && !search_pondering.load(std::memory_order_relaxed)) {
+            double scale = STABILITY_SCALE[bestMoveStability] * (1.0 + std::min(std::max(scoreDrop, 0), 100) / 200.0);
+            long long elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - search_start_time).count();
+            if (elapsed_ms >= search_limits.softTimeMs * scale) { break; }
         }
+        if (search_limits.mate && td.bestScore >= MATE_IN_MAX_PLY && (MATE_SCORE - td.bestScore + 1) / 2 <= search_limits.mate) { break; }
+        if (abs(td.bestScore) >= MATE_IN_MAX_PLY && !search_limits.mate) { break; }
+
+    } // End Iterative Deepening Loop
+}
+
+struct SearchResult {
+    bool hasMove;
+    Move bestMove;
+    Move ponderMove; // The expected reply from the PV, Move() if the PV ends after bestMove
+    std::vector<Move> pv; // Starts with bestMove, empty if no iteration completed
+    int score;
+    int depth;
+    uint64_t nodes;
+};
+
+// Runs a search from the given position on all search threads and returns the move of the thread with
+// the deepest completed iteration (the main thread on ties). The caller clears time_is_up beforehand, so
+// that a "stop" arriving before the search has started is not lost.
+SearchResult runSearch(const BoardState& root, const SearchLimits& limits) {
+    search_limits = limits;
+    search_start_time = std::chrono::steady_clock::now();
+    transpositionTable.newSearch();
+    for (auto& td : search_threads) {
+        td->board = root;
+        td->nodes.store(0, std::memory_order_relaxed);
+        td->tbHits.store(0, std::memory_order_relaxed);
+#ifdef SEARCH_STATS
+        td->stats = SearchStats();
+#endif
+        td->completedDepth = 0;
+        td->bestScore = 0;
+        td->bestMove = Move();
+        td->rootPvLength = 0;
+        td->rng.seed(global_rng());
+        for (auto& plyKillers : td->killers) plyKillers[0] = plyKillers[1] = Move();
+    }
+
+#ifdef USE_SYZYGY
+    // A root in the tablebases searches only the moves that keep its result (within "searchmoves")
+    std::vector<Move> tbMoves;
+    if (tablebaseRootMoves(root, tbMoves)) {
+        search_threads[0]->tbHits.store(1, std::memory_order_relaxed);
+        std::vector<Move>& only = search_limits.searchMoves;
+        std::vector<Move> allowed;
+        for (const Move& move : tbMoves) if (only.empty() || std::find(only.begin(), only.end(), move) != only.end()) allowed.push_back(move);
+        if (!allowed.empty()) only = allowed;
     }
+#endif
+
+    std::vector<std::thread> helpers;
+    for (size_t i = 1; i < search_threads.size(); ++i) helpers.emplace_back(iterativeDeepening, std::ref(*search_threads[i]));
+    iterativeDeepening(*search_threads[0]);
+    // In infinite and ponder mode the bestmove may only be sent after "stop" or "ponderhit"
+    while ((search_limits.infinite || search_pondering.load()) && !time_is_up.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    time_is_up.store(true, std::memory_order_relaxed); // The main thread is done: stop the helpers
+    for (auto& helper : helpers) helper.join();
+#ifdef SEARCH_STATS
+    {
+        SearchStats total;
+        for (auto& td : search_threads) total.add(td->stats);
+        std::lock_guard<std::mutex> lock(io_mutex);
+        last_search_stats = total;
+    }
+#endif
+
+    SearchThread* best = search_threads[0].get();
+    for (auto& td : search_threads) if (td->completedDepth > best->completedDepth) best = td.get();
+
+    SearchResult result;
+    MoveList rootMoves;
+    BoardState rootCopy = root;
+    generateLegalMoves(rootCopy, rootMoves, false);
+    result.hasMove = !rootMoves.empty();
+    result.bestMove = best->bestMove;
+    result.ponderMove = (result.hasMove && best->rootPvLength >= 2 && best->rootPv[0] == best->bestMove) ? best->rootPv[1] : Move();
+    if (result.hasMove && best->rootPvLength > 0 && best->rootPv[0] == best->bestMove) result.pv.assign(best->rootPv, best->rootPv + best->rootPvLength);
+    result.score = best->bestScore;
+    result.depth = best->completedDepth;
+    result.nodes = totalNodesSearched();
+    return result;
+}
+
+// --- Asynchronous Search ---
+// "go" starts the search on search_worker and returns, so the UCI loop keeps reading commands. The worker
+// prints bestmove itself; "stop" and "quit" raise time_is_up, which every node checks, and join it.
+std::thread search_worker;
+bool search_is_infinite = false; // The worker's search is "go infinite"; only the UCI thread uses it
+
+void waitForSearch() { if (search_worker.joinable()) search_worker.join(); }
+void stopSearch() {
+    search_pondering.store(false);
+    time_is_up.store(true);
+    waitForSearch();
 }
 
 // --- Main Search Control (handleGo) with Dynamic Time Allocation ---
@@ -781,146 +2575,587 @@ void handleGo(std::istringstream& iss) {
     long long wtime_ms = -1, btime_ms = -1, winc_ms = 0, binc_ms = 0;
     int movestogo = 0; 
     long long movetime_ms = -1; 
+    bool infinite = false, ponder = false;
+    SearchLimits limits;
+    bool searchMovesToken = false; // Inside the "searchmoves" list, which runs until the next keyword
 
     while(iss >> token) { 
-        if (token == "wtime") iss >> wtime_ms;
+        if (token == "infinite") infinite = true;
+        else if (token == "ponder") ponder = true;
+        else if (token == "wtime") iss >> wtime_ms;
         else if (token == "btime") iss >> btime_ms;
         else if (token == "winc") iss >> winc_ms;
         else if (token == "binc") iss >> binc_ms;
         else if (token == "movestogo") iss >> movestogo;
         else if (token == "movetime") iss >> movetime_ms;
+        else if (token == "depth") { iss >> limits.depth; limits.depth = std::max(1, std::min(limits.depth, MAX_SEARCH_PLY)); }
+        else if (token == "nodes") iss >> limits.nodes;
+        else if (token == "mate") iss >> limits.mate;
+        else if (token == "searchmoves") { searchMovesToken = true; continue; }
+        else if (searchMovesToken) {
+            MoveList legal;
+            generateLegalMoves(currentBoard, legal, false);
+            for (const Move& move : legal) {
+                if (move.toUci() == token) { limits.searchMoves.push_back(move); break; }
+            }
+            continue;
+        }
+        searchMovesToken = false;
     }
     
-    long long allocated_ms;
+    // The soft limit is the target for the move: no new iteration starts past it (scaled by best move
+    // stability). The hard limit aborts the search mid-iteration and leaves room for unstable positions.
     long long time_buffer_ms = 100; 
+    long long my_time = currentBoard.whiteToMove ? wtime_ms : btime_ms;
+    long long my_inc = currentBoard.whiteToMove ? winc_ms : binc_ms;
+
+    if (infinite) {
+        // No time limit; depth, nodes and mate still apply
+    } else if (movetime_ms != -1) {
+        limits.timeLimitMs = std::max(10LL, movetime_ms - time_buffer_ms);
+    } else if (my_time != -1) {
+        int moves_remaining = (movestogo > 0 && movestogo < 80) ? movestogo : 35; 
+        long long soft_ms = std::max(10LL, my_time / moves_remaining + my_inc * 3 / 4 - time_buffer_ms);
+        long long hard_ms = std::max(10LL, std::min(soft_ms * 4, my_time / 2 - time_buffer_ms));
+        limits.softTimeMs = std::min(soft_ms, hard_ms);
+        limits.timeLimitMs = hard_ms;
+    } else if (limits.depth == MAX_SEARCH_PLY && !limits.nodes && !limits.mate) {
+        limits.timeLimitMs = 2000 - time_buffer_ms; // Plain "go"
+    }
+    limits.infinite = infinite;
+
+    stopSearch(); // Never run two searches at once
+
+    // In game play a book move is sent at once. Analysis ("infinite", fixed depth, nodes or mate, searchmoves)
+    // and pondering always search.
+    bool analysis = infinite || ponder || limits.depth != MAX_SEARCH_PLY || limits.nodes || limits.mate || !limits.searchMoves.empty();
+    Move bookMove = analysis ? Move() : probeBook(currentBoard);
+    if (bookMove != Move()) {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        std::cout << "info string book move " << bookMove.toUci() << "\nbestmove " << bookMove.toUci() << std::endl;
+        return;
+    }
 
-    if (movetime_ms != -1) {
-        allocated_ms = std::max(10LL, movetime_ms - time_buffer_ms);
+    time_is_up.store(false);
+    search_pondering.store(ponder);
+    search_is_infinite = infinite;
+    search_worker = std::thread([limits] {
+        SearchResult result = runSearch(currentBoard, limits);
+        std::lock_guard<std::mutex> lock(io_mutex);
+        std::cout << "bestmove " << (result.hasMove ? result.bestMove.toUci() : "0000");
+        if (result.hasMove && result.ponderMove != Move()) std::cout << " ponder " << result.ponderMove.toUci();
+        std::cout << std::endl;
+    });
+}
+// "stats": the search statistics of the last completed search, see Search Statistics
+void handleStats() {
+    std::lock_guard<std::mutex> lock(io_mutex);
+#ifdef SEARCH_STATS
+    std::cout << "info string stats " << last_search_stats.format() << std::endl;
+#else
+    std::cout << "info string search statistics are not compiled in, build with -DSEARCH_STATS" << std::endl;
+#endif
+}
+
+// "savehash <file>" / "loadhash <file>": see Hash Files
+void handleHashFile(std::istringstream& iss, bool save) {
+    std::string path;
+    std::getline(iss >> std::ws, path);
+    if (path.empty()) { std::cout << "info string usage: " << (save ? "savehash" : "loadhash") << " <file>" << std::endl; return; }
+    if (save) {
+        std::cout << "info string " << (saveHash(path) ? "saved hash to " : "failed to save hash to ") << path << std::endl;
+    } else if (loadHash(path)) {
+        std::cout << "info string loaded " << transpositionTable.sizeMb << " MB hash from " << path << std::endl;
     } else {
-        long long my_time = currentBoard.whiteToMove ? wtime_ms : btime_ms;
-        long long my_inc = currentBoard.whiteToMove ? winc_ms : binc_ms;
-        if (my_time != -1) {
-             int moves_remaining = (movestogo > 0 && movestogo < 80) ? movestogo : 35; 
-             allocated_ms = (my_time / moves_remaining) + my_inc - time_buffer_ms;
-             allocated_ms = std::min(allocated_ms, my_time / 2 - time_buffer_ms); 
-             allocated_ms = std::max(10LL, allocated_ms); 
-        } else {
-            allocated_ms = 2000 - time_buffer_ms; 
-        }
+        std::cout << "info string failed to load hash from " << path << ", keeping the current table" << std::endl;
     }
-    
-    std::chrono::milliseconds timeLimit(allocated_ms);
-    
-    auto startTime = std::chrono::steady_clock::now();
-    time_is_up.store(false, std::memory_order_relaxed); 
-    nodes_searched.store(0, std::memory_order_relaxed); 
+}
 
-    std::vector<Move> legalEngineMoves;
-    generateLegalMoves(currentBoard, legalEngineMoves, false);
-    if (legalEngineMoves.empty()) { std::cout << "bestmove 0000" << std::endl; return; }
+// "makebook <input> <output>": see makeBook
+void handleMakeBook(std::istringstream& iss) {
+    std::string input, output;
+    if (!(iss >> input >> output)) { std::cout << "info string usage: makebook <input> <output>" << std::endl; return; }
+    long long entries = makeBook(input, output);
+    if (entries < 0) std::cout << "info string failed to make a book from " << input << std::endl;
+    else std::cout << "info string wrote " << entries << " book entries to " << output << std::endl;
+}
 
-    orderMoves(currentBoard, legalEngineMoves); 
+// The opponent played the expected move: the ponder search carries on as a normal timed search.
+// Time spent pondering counts towards the allocation, so a long ponder can mean an instant reply.
+void handlePonderHit() { search_pondering.store(false); }
+
+// "scaling [depth]": searches a fixed set of positions to a fixed depth with 1, 2, 4, 8 and 16 threads
+// and reports NPS and time-to-depth for each, to check how well the Lazy SMP search scales.
+const char* const SCALING_FENS[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+};
 
-    Move bestMoveOverall = legalEngineMoves[0]; 
-    Move bestMoveThisIteration = legalEngineMoves[0];
-    int bestEvalOverall = std::numeric_limits<int>::min();
+void handleScaling(std::istringstream& iss) {
+    int depth = 6;
+    iss >> depth;
+    depth = std::max(1, std::min(depth, MAX_SEARCH_PLY));
+    size_t savedThreads = search_threads.size();
+    long long baseTime = 0;
+    for (int threads : {1, 2, 4, 8, 16}) {
+        setThreadCount(threads);
+        long long totalTime = 0;
+        uint64_t totalNodes = 0;
+        for (const char* fen : SCALING_FENS) {
+            BoardState board; board.parseFen(fen);
+            transpositionTable.clear();
+            time_is_up.store(false);
+            SearchLimits limits;
+            limits.depth = depth;
+            limits.printInfo = false;
+            auto start = std::chrono::steady_clock::now();
+            SearchResult result = runSearch(board, limits);
+            totalTime += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            totalNodes += result.nodes;
+        }
+        if (threads == 1) baseTime = std::max(1LL, totalTime);
+        std::cout << "info string threads " << threads << " depth " << depth
+                  << " time " << totalTime << " nodes " << totalNodes
+                  << " nps " << (totalTime > 0 ? totalNodes * 1000 / totalTime : 0)
+                  << " speedup " << (double)baseTime / std::max(1LL, totalTime) << std::endl;
+    }
+    setThreadCount((int)savedThreads);
+}
 
+// "bench [depth] [threads] [hash]": searches a fixed set of positions to a fixed depth, each from an
+// empty table and without the random tie-break, and prints the total node count as a signature of the
+// search. With one thread (the default) the count is the same on every run of the same binary, so a
+// change in NPS between builds with equal signatures comes from speed alone.
+const char* const BENCH_FENS[] = {
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1",
+    "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1",
+    "r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+    "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8",
+    "r1bqkb1r/pppp1ppp/2n2n2/4p3/2B1P3/5N2/PPPP1PPP/RNBQK2R w KQkq - 4 4",
+    "r2q1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP1B1PPP/R2QKB1R w KQ - 0 9",
+    "2r3k1/pp3ppp/4p3/3pP3/3P4/P4N2/1P3PPP/2R3K1 b - - 0 24",
+    "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+    "8/8/4kpp1/3p1b2/p6P/2B5/6P1/6K1 b - - 2 47",
+    "6k1/5p2/6p1/8/7p/8/6PP/6K1 b - - 0 1",
+};
 
-    bool isEngineWhite = currentBoard.whiteToMove;
+void handleBench(std::istringstream& iss) {
+    int depth = 8, threads = 1;
+    size_t hashMb = 16;
+    iss >> depth >> threads >> hashMb;
+    depth = std::max(1, std::min(depth, MAX_SEARCH_PLY));
+    size_t savedThreads = search_threads.size(), savedHashMb = transpositionTable.sizeMb;
+    setThreadCount(threads);
+    if (hashMb != savedHashMb) transpositionTable.resize(hashMb);
+
+    uint64_t totalNodes = 0;
+    long long totalTime = 0;
+    for (const char* fen : BENCH_FENS) {
+        BoardState board; board.parseFen(fen);
+        transpositionTable.clear();
+        clearSearchHistory();
+        time_is_up.store(false);
+        SearchLimits limits;
+        limits.depth = depth;
+        limits.printInfo = false;
+        limits.randomTieBreak = false;
+        auto start = std::chrono::steady_clock::now();
+        SearchResult result = runSearch(board, limits);
+        totalTime += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        totalNodes += result.nodes;
+        std::cout << "info string " << fen << " bestmove " << (result.hasMove ? result.bestMove.toUci() : "0000")
+                  << " nodes " << result.nodes << std::endl;
+    }
+    std::cout << "info string bench depth " << depth << " threads " << search_threads.size()
+              << " hash " << transpositionTable.sizeMb << " time " << totalTime << " nodes " << totalNodes
+              << " nps " << (totalTime > 0 ? totalNodes * 1000 / totalTime : 0) << std::endl;
 
-    // Iterative Deepening Loop
-    for (int currentDepth = 1; currentDepth <= MAX_SEARCH_PLY; ++currentDepth) {
-        auto iterationStartTime = std::chrono::steady_clock::now(); 
-        int currentIterBestEval = std::numeric_limits<int>::min(); 
-        std::vector<Move> candidateBestMovesThisIteration;
-        
-        uint64_t nodes_at_start_of_iter = nodes_searched.load(std::memory_order_relaxed); 
-
-        for (const auto& engineMove : legalEngineMoves) { 
-            BoardState boardAfterEngineMove = currentBoard;
-            apply_raw_move_to_board(boardAfterEngineMove, engineMove); 
-            int evalFromWhitePerspective = alphaBetaSearch(boardAfterEngineMove, currentDepth - 1, 
-                                                           std::numeric_limits<int>::min(), 
-                                                           std::numeric_limits<int>::max(), 
-                                                           !isEngineWhite, 
-                                                           startTime, timeLimit);
-            
-            if (time_is_up.load(std::memory_order_relaxed)) break; 
-
-            int currentMoveScoreForEngine; 
-            if (isEngineWhite) { 
-                currentMoveScoreForEngine = evalFromWhitePerspective;
-            } else { 
-                currentMoveScoreForEngine = -evalFromWhitePerspective; 
-            }
-            
-            if (currentMoveScoreForEngine > currentIterBestEval) {
-                currentIterBestEval = currentMoveScoreForEngine;
-                candidateBestMovesThisIteration.clear();
-                candidateBestMovesThisIteration.push_back(engineMove);
-            } else if (currentMoveScoreForEngine == currentIterBestEval) {
-                candidateBestMovesThisIteration.push_back(engineMove);
-            }
-        } 
+    setThreadCount((int)savedThreads);
+    if (transpositionTable.sizeMb != savedHashMb) transpositionTable.resize(savedHashMb);
+}
 
-        if (time_is_up.load(std::memory_order_relaxed)) { break; }
+// --- Perft ---
+// Counts the leaf nodes of the legal move tree, to validate move generation and make/unmake.
+// Optional hash: one lockless slot per index (check = key ^ data), data = count << 8 | depth.
+struct PerftHashEntry {
+    std::atomic<uint64_t> check;
+    std::atomic<uint64_t> data;
+};
 
-        if (!candidateBestMovesThisIteration.empty()) {
-            std::uniform_int_distribution<int> distrib(0, candidateBestMovesThisIteration.size() - 1);
-            bestMoveThisIteration = candidateBestMovesThisIteration[distrib(global_rng)];
-            bestMoveOverall = bestMoveThisIteration; 
-            bestEvalOverall = currentIterBestEval; 
-            
-            auto iterationEndTime = std::chrono::steady_clock::now();
-            auto iterationDuration = std::chrono::duration_cast<std::chrono::milliseconds>(iterationEndTime - iterationStartTime);
-            uint64_t nodes_this_iter = nodes_searched.load(std::memory_order_relaxed) - nodes_at_start_of_iter;
-            uint64_t nps = (iterationDuration.count() > 0) ? (nodes_this_iter * 1000 / iterationDuration.count()) : 0;
-
-            int uci_score_val = bestEvalOverall;
-            std::string uci_score_type = "cp";
-
-            // Refined mate score reporting
-            if (abs(uci_score_val) > MATE_SCORE - MAX_SEARCH_PLY * 2 ) { 
-                uci_score_type = "mate";
-                // Calculate mate in X moves. Positive if engine is mating, negative if engine is being mated.
-                // Number of ply to mate from the *root* of the current ID iteration
-                int ply_to_mate_from_root = MATE_SCORE - abs(uci_score_val); 
-                // Convert ply to moves. Add currentDepth to account for plies already searched in this ID iteration.
-                int moves_to_mate = (ply_to_mate_from_root + currentDepth + 1) / 2;       
-                uci_score_val = (bestEvalOverall > 0) ? moves_to_mate : -moves_to_mate;
-            }
+struct PerftHash {
+    std::unique_ptr<PerftHashEntry[]> entries;
+    size_t entryCount = 0;
+
+    explicit PerftHash(size_t mb) {
+        entryCount = std::max<size_t>(1, mb * 1024 * 1024 / sizeof(PerftHashEntry));
+        entries.reset(new PerftHashEntry[entryCount]()); // Zeroed: a zero slot never matches a position
+    }
+    PerftHashEntry& entryFor(uint64_t key) { return entries[(unsigned __int128)key * entryCount >> 64]; }
+    bool probe(uint64_t key, int depth, uint64_t& count) {
+        PerftHashEntry& e = entryFor(key);
+        uint64_t data = e.data.load(std::memory_order_relaxed);
+        if ((e.check.load(std::memory_order_relaxed) ^ data) != key || (int)(data & 0xFF) != depth) return false;
+        count = data >> 8;
+        return true;
+    }
+    void store(uint64_t key, int depth, uint64_t count) {
+        PerftHashEntry& e = entryFor(key);
+        uint64_t data = count << 8 | (uint64_t)depth;
+        e.check.store(key ^ data, std::memory_order_relaxed);
+        e.data.store(data, std::memory_order_relaxed);
+    }
+};
 
+// Depth 1 is counted in bulk from the size of the legal move list.
+uint64_t perft(BoardState& board, int depth, PerftHash* hash) {
+    MoveList moves;
+    generateLegalMoves(board, moves, false);
+    if (depth <= 1) return moves.size();
+    uint64_t count = 0;
+    if (hash && hash->probe(board.hashKey, depth, count)) return count;
+    for (const Move& move : moves) {
+        board.doMove(move);
+        count += perft(board, depth - 1, hash);
+        board.undoMove(move);
+    }
+    if (hash) hash->store(board.hashKey, depth, count);
+    return count;
+}
 
-            std::cout << "info depth " << currentDepth 
-                      << " score " << uci_score_type << " " << uci_score_val
-                      << " time " << iterationDuration.count() 
-                      << " nodes " << nodes_this_iter
-                      << " nps " << nps
-                      << " pv " << bestMoveOverall.toUci() << std::endl; 
+// Splits the root moves over `threads` threads, each taking the next unclaimed move until none are left.
+// Returns the total; counts[i] receives the count below rootMoves[i].
+uint64_t perftRoot(const BoardState& root, int depth, int threads, PerftHash* hash,
+                   MoveList& rootMoves, std::vector<uint64_t>& counts) {
+    BoardState rootCopy = root;
+    generateLegalMoves(rootCopy, rootMoves, false);
+    counts.assign(rootMoves.size(), 0);
+    if (depth <= 0) { rootMoves.clear(); counts.clear(); return 1; }
+
+    std::atomic<size_t> nextMove(0);
+    auto worker = [&] {
+        BoardState board = root;
+        for (size_t i; (i = nextMove.fetch_add(1)) < (size_t)rootMoves.size(); ) {
+            board.doMove(rootMoves[i]);
+            counts[i] = (depth == 1) ? 1 : perft(board, depth - 1, hash);
+            board.undoMove(rootMoves[i]);
+        }
+    };
+    std::vector<std::thread> helpers;
+    for (int i = 1; i < threads; ++i) helpers.emplace_back(worker);
+    worker();
+    for (auto& helper : helpers) helper.join();
+
+    uint64_t total = 0;
+    for (uint64_t c : counts) total += c;
+    return total;
+}
 
-        } else { break; }
+struct PerftSuiteEntry {
+    const char* fen;
+    int depth;
+    uint64_t nodes;
+};
 
-        if (std::chrono::steady_clock::now() - startTime >= timeLimit) { break; }
-        if (abs(bestEvalOverall) >= MATE_SCORE - MAX_SEARCH_PLY*2) { break; }
+// Standard positions plus the usual en passant, castling and promotion traps.
+const PerftSuiteEntry PERFT_SUITE[] = {
+    {"rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", 5, 4865609},
+    {"r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4, 4085603},
+    {"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5, 674624},
+    {"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 4, 422333},
+    {"rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4, 2103487},
+    {"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10", 4, 3894594},
+    {"3k4/3p4/8/K1P4r/8/8/8/8 b - - 0 1", 6, 1134888},
+    {"8/8/4k3/8/2p5/8/B2P2K1/8 w - - 0 1", 6, 1015133},
+    {"8/8/1k6/2b5/2pP4/8/5K2/8 b - d3 0 1", 6, 1440467},
+    {"5k2/8/8/8/8/8/8/4K2R w K - 0 1", 6, 661072},
+    {"3k4/8/8/8/8/8/8/R3K3 w Q - 0 1", 6, 803711},
+    {"r3k2r/1b4bq/8/8/8/8/7B/R3K2R w KQkq - 0 1", 4, 1274206},
+    {"r3k2r/8/3Q4/8/8/5q2/8/R3K2R b KQkq - 0 1", 4, 1720476},
+    {"2K2r2/4P3/8/8/8/8/8/3k4 w - - 0 1", 6, 3821001},
+    {"8/8/1P2K3/8/2n5/1q6/8/5k2 b - - 0 1", 5, 1004658},
+    {"4k3/1P6/8/8/8/8/K7/8 w - - 0 1", 6, 217342},
+    {"8/P1k5/K7/8/8/8/8/8 w - - 0 1", 6, 92683},
+    {"K1k5/8/P7/8/8/8/8/8 w - - 0 1", 6, 2217},
+    {"8/k1P5/8/1K6/8/8/8/8 w - - 0 1", 7, 567584},
+    {"8/8/2k5/5q2/5n2/8/5K2/8 b - - 0 1", 4, 23527},
+};
 
-    } // End Iterative Deepening Loop
+// "perft <depth> [threads <n>] [hash <mb>]", "divide <depth> ..." and "perft suite [threads <n>] [hash <mb>]".
+// Threads default to the Threads option; the perft hash is off unless a size is given.
+void handlePerft(std::istringstream& iss, bool divide) {
+    std::string token;
+    int depth = 1, threads = (int)search_threads.size();
+    size_t hashMb = 0;
+    bool suite = false;
+    while (iss >> token) {
+        if (token == "suite") suite = true;
+        else if (token == "threads") iss >> threads;
+        else if (token == "hash") iss >> hashMb;
+        else depth = std::atoi(token.c_str());
+    }
+    depth = std::max(0, std::min(depth, MAX_PLY - 1));
+    threads = std::max(1, std::min(threads, MAX_THREADS));
+    std::unique_ptr<PerftHash> hash;
+    if (hashMb > 0) hash.reset(new PerftHash(hashMb));
+
+    MoveList rootMoves;
+    std::vector<uint64_t> counts;
+    auto report = [](const std::string& prefix, uint64_t nodes, long long ms) {
+        std::cout << prefix << "nodes " << nodes << " time " << ms
+                  << " nps " << (ms > 0 ? nodes * 1000 / ms : 0) << std::endl;
+    };
+
+    if (!suite) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t nodes = perftRoot(currentBoard, depth, threads, hash.get(), rootMoves, counts);
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        if (divide) for (int i = 0; i < rootMoves.size(); ++i) std::cout << rootMoves[i].toUci() << ": " << counts[i] << "\n";
+        report("perft depth " + std::to_string(depth) + " ", nodes, ms);
+        return;
+    }
 
-    std::cout << "bestmove " << bestMoveOverall.toUci() << std::endl;
+    int failures = 0;
+    uint64_t totalNodes = 0;
+    long long totalMs = 0;
+    for (const PerftSuiteEntry& entry : PERFT_SUITE) {
+        BoardState board; board.parseFen(entry.fen);
+        auto start = std::chrono::steady_clock::now();
+        uint64_t nodes = perftRoot(board, entry.depth, threads, hash.get(), rootMoves, counts);
+        long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        bool ok = (nodes == entry.nodes);
+        if (!ok) ++failures;
+        totalNodes += nodes;
+        totalMs += ms;
+        std::cout << (ok ? "ok   " : "FAIL ") << entry.fen << " depth " << entry.depth;
+        if (!ok) std::cout << " expected " << entry.nodes;
+        report(" ", nodes, ms);
+    }
+    report("perft suite " + std::to_string(failures) + " failures ", totalNodes, totalMs);
 }
 
 // Main loop 
-int main() {
+// --- Batch Analysis ---
+// "Geminina analyse --input <file> [--output <file>] [--depth <n>] [--jobs <k>] [--hash <mb>]" searches
+// every FEN or EPD line of the input to a fixed depth and writes one line per position, in input order:
+//   <position> ; bestmove <move> ; score <cp x | mate y> ; depth <n> ; nodes <n> ; pv <moves>
+// or "<position> ; error invalid position" if it does not have exactly one king per side. EPD operations
+// after the position fields are ignored. The search state is global, so each of the k workers is a forked
+// process with its own table (--hash MB, default 16) and a single search thread. The input is streamed,
+// at most ANALYSE_WINDOW_PER_JOB positions per worker are in flight or waiting to be written, and every
+// position starts from a cleared table, so the output does not depend on k.
+const int ANALYSE_WINDOW_PER_JOB = 64;
+
+// The position fields of a FEN or EPD line (board, side, castling, en passant, then the two counters only
+// if present), or "" if there is no position on the line
+std::string positionFields(const std::string& line) {
+    std::istringstream in(line);
+    std::string field, fen;
+    for (int i = 0; i < 6 && in >> field; ++i) {
+        if (i >= 4 && field.find_first_not_of("0123456789") != std::string::npos) break;
+        fen += (i ? " " : "") + field;
+    }
+    return std::count(fen.begin(), fen.end(), ' ') >= 3 ? fen : "";
+}
+
+std::string analysePosition(const std::string& fen, int depth) {
+    BoardState board;
+    if (!board.parseFen(fen)) return fen + " ; error invalid position";
+    transpositionTable.clear();
+    clearSearchHistory();
+    time_is_up.store(false);
+    SearchLimits limits;
+    limits.depth = depth;
+    limits.printInfo = false;
+    limits.randomTieBreak = false;
+    SearchResult result = runSearch(board, limits);
+    std::ostringstream out;
+    out << fen << " ; bestmove " << (result.hasMove ? result.bestMove.toUci() : "0000");
+    if (result.hasMove) out << " ; score " << uciScore(result.score) << " ; depth " << result.depth;
+    out << " ; nodes " << result.nodes << " ; pv";
+    for (const Move& move : result.pv) out << " " << move.toUci();
+    return out.str();
+}
+
+#ifndef _WIN32
+// A forked worker: reads "<index> <fen>" lines from its pipe and answers "<index> <result>" lines
+struct AnalyseWorker {
+    pid_t pid = -1;
+    int toWorker = -1, fromWorker = -1;
+    std::string received; // Output read but not yet split into lines
+    int inFlight = 0;
+};
+
+void runAnalyseWorker(int in, int out, int depth) {
+    FILE* input = fdopen(in, "r");
+    char* line = nullptr;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, input) > 0) {
+        std::string request(line);
+        size_t space = request.find(' ');
+        std::string reply = request.substr(0, space) + " " + analysePosition(positionFields(request.substr(space + 1)), depth) + "\n";
+        for (size_t written = 0; written < reply.size(); ) {
+            ssize_t n = write(out, reply.data() + written, reply.size() - written);
+            if (n <= 0) _exit(1);
+            written += (size_t)n;
+        }
+    }
+    _exit(0); // Skip the destructors of state shared with the parent
+}
+#endif
+
+int runAnalyse(int argc, char* argv[]) {
+    std::string inputPath, outputPath = "-";
+    int depth = 10, jobs = (int)std::max(1u, std::thread::hardware_concurrency());
+    size_t hashMb = 16;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        std::string flag = argv[i], value = argv[i + 1];
+        if (flag == "--input") inputPath = value;
+        else if (flag == "--output") outputPath = value;
+        else if (flag == "--depth") depth = std::max(1, std::min(std::atoi(value.c_str()), MAX_SEARCH_PLY));
+        else if (flag == "--jobs") jobs = std::max(1, std::min(std::atoi(value.c_str()), MAX_THREADS));
+        else if (flag == "--hash") hashMb = (size_t)std::max(1, std::atoi(value.c_str()));
+    }
+    std::ifstream input(inputPath);
+    if (inputPath.empty() || !input) {
+        std::cerr << "usage: Geminina analyse --input <file> [--output <file>] [--depth <n>] [--jobs <k>] [--hash <mb>]" << std::endl;
+        return 1;
+    }
+    std::ofstream outputFile;
+    if (outputPath != "-") outputFile.open(outputPath);
+    std::ostream& output = (outputPath == "-") ? std::cout : outputFile;
+    transpositionTable.resize(hashMb);
+    setThreadCount(1);
+
+    // Positions in input order, read as the window allows; blank lines and "#" comments are skipped
+    long long nextIndex = 0;
+    auto readPosition = [&](std::string& fen) {
+        std::string line;
+        while (std::getline(input, line)) {
+            if (line.empty() || line[0] == '#' || (fen = positionFields(line)).empty()) continue;
+            return true;
+        }
+        return false;
+    };
+
+#ifdef _WIN32
+    (void)jobs; // No fork: the positions are searched one after another in this process
+    std::string fen;
+    while (readPosition(fen)) output << analysePosition(fen, depth) << "\n" << std::flush;
+#else
+    signal(SIGPIPE, SIG_IGN);
+    std::vector<AnalyseWorker> workers(jobs);
+    for (AnalyseWorker& worker : workers) {
+        int down[2], up[2];
+        if (pipe(down) != 0 || pipe(up) != 0) { std::cerr << "analyse: pipe failed" << std::endl; return 1; }
+        worker.pid = fork();
+        if (worker.pid == 0) {
+            for (const AnalyseWorker& other : workers) { // Drop the parent's ends of earlier workers' pipes
+                if (other.toWorker >= 0) ::close(other.toWorker);
+                if (other.fromWorker >= 0) ::close(other.fromWorker);
+            }
+            ::close(down[1]); ::close(up[0]);
+            runAnalyseWorker(down[0], up[1], depth);
+        }
+        ::close(down[0]); ::close(up[1]);
+        if (worker.pid < 0) { std::cerr << "analyse: fork failed" << std::endl; return 1; }
+        worker.toWorker = down[1];
+        worker.fromWorker = up[0];
+    }
+
+    std::map<long long, std::string> pending; // Results that arrived before an earlier position's
+    long long nextToWrite = 0;
+    bool inputDone = false;
+    int inFlight = 0;
+    const long long window = (long long)ANALYSE_WINDOW_PER_JOB * jobs;
+    while (true) {
+        // Keep every worker busy with two positions, so it never waits for the parent
+        for (AnalyseWorker& worker : workers) {
+            while (!inputDone && worker.inFlight < 2 && nextIndex - nextToWrite < window) {
+                std::string fen;
+                if (!readPosition(fen)) { inputDone = true; break; }
+                std::string request = std::to_string(nextIndex++) + " " + fen + "\n";
+                if (write(worker.toWorker, request.data(), request.size()) != (ssize_t)request.size()) {
+                    std::cerr << "analyse: worker " << worker.pid << " stopped" << std::endl;
+                    return 1;
+                }
+                worker.inFlight++;
+                inFlight++;
+            }
+        }
+        if (inFlight == 0) break;
+
+        std::vector<pollfd> fds;
+        for (const AnalyseWorker& worker : workers) fds.push_back({worker.fromWorker, POLLIN, 0});
+        if (poll(fds.data(), fds.size(), -1) < 0) continue;
+        for (size_t w = 0; w < workers.size(); ++w) {
+            if (!(fds[w].revents & (POLLIN | POLLHUP))) continue;
+            AnalyseWorker& worker = workers[w];
+            char buffer[65536];
+            ssize_t n = read(worker.fromWorker, buffer, sizeof(buffer));
+            if (n <= 0) { std::cerr << "analyse: worker " << worker.pid << " stopped" << std::endl; return 1; }
+            worker.received.append(buffer, (size_t)n);
+            size_t end;
+            while ((end = worker.received.find('\n')) != std::string::npos) {
+                std::string reply = worker.received.substr(0, end);
+                worker.received.erase(0, end + 1);
+                size_t space = reply.find(' ');
+                pending[std::stoll(reply.substr(0, space))] = reply.substr(space + 1);
+                worker.inFlight--;
+                inFlight--;
+            }
+        }
+        for (auto it = pending.begin(); it != pending.end() && it->first == nextToWrite; it = pending.erase(it), ++nextToWrite)
+            output << it->second << "\n";
+        output.flush();
+    }
+    for (AnalyseWorker& worker : workers) {
+        ::close(worker.toWorker); // End of input: the worker exits
+        ::close(worker.fromWorker);
+        waitpid(worker.pid, nullptr, 0);
+    }
+#endif
+    return output ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
     std::ios_base::sync_with_stdio(false); 
     global_rng.seed(std::chrono::steady_clock::now().time_since_epoch().count()); 
+    initBitboards();
+    initZobrist();
+    initCastlingMasks();
+    initPsqt();
+    initReductions();
+    initPolyglot();
+    currentBoard.reset(); // Recompute the key now that the Zobrist tables are filled
+    if (argc > 1 && std::string(argv[1]) == "analyse") return runAnalyse(argc, argv);
+    transpositionTable.resize(TT_DEFAULT_MB);
+    setThreadCount(1);
     std::string line;
+    bool command_was_quit = false;
     while (std::getline(std::cin, line)) {
         std::istringstream iss(line); std::string command; iss >> command;
         if (command == "uci") { handleUci(); } 
-        else if (command == "isready") { handleIsReady(); } 
-        else if (command == "ucinewgame") { handleUciNewGame(); } 
-        else if (command == "position") { handlePosition(iss); } 
+        else if (command == "isready") { handleIsReady(); } // Answered at once, even while searching
+        else if (command == "ucinewgame") { stopSearch(); handleUciNewGame(); } 
+        else if (command == "setoption") { stopSearch(); handleSetOption(iss); } 
+        else if (command == "position") { stopSearch(); handlePosition(iss); } 
         else if (command == "go") { handleGo(iss); } 
-        else if (command == "quit") { break; }
+        else if (command == "stop") { stopSearch(); } 
+        else if (command == "ponderhit") { handlePonderHit(); } 
+        else if (command == "scaling") { stopSearch(); handleScaling(iss); }
+        else if (command == "bench") { stopSearch(); handleBench(iss); }
+        else if (command == "stats") { handleStats(); } // Answered at once, even while searching
+        else if (command == "savehash") { stopSearch(); handleHashFile(iss, true); }
+        else if (command == "loadhash") { stopSearch(); handleHashFile(iss, false); }
+        else if (command == "makebook") { stopSearch(); handleMakeBook(iss); }
+        else if (command == "perft") { stopSearch(); handlePerft(iss, false); }
+        else if (command == "divide") { stopSearch(); handlePerft(iss, true); }
+        else if (command == "quit") { command_was_quit = true; break; }
     }
+    // On "quit" stop at once. If input just ended, let a timed search finish and print its move.
+    if (command_was_quit || search_is_infinite || search_pondering.load()) stopSearch();
+    waitForSearch();
     return 0;
 }